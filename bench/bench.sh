@@ -0,0 +1,95 @@
+#!/usr/bin/env bash
+#
+# Benchmarks for smallsh, run by `make bench`.
+#
+# Each benchmark generates a script of COUNT lines and runs it through smallsh
+# in batch mode, printing one JSON line per benchmark:
+#   {"bench":"launch","ops":2000,"seconds":1.234,"ops_per_sec":1620.7}
+# followed by the startup latency of smallsh itself, from --startup-bench.
+#
+# Usage: bench/bench.sh [smallsh binary] [count]
+
+set -euo pipefail
+
+SHELL_BIN=$(realpath "${1:-./smallsh}")
+COUNT=${2:-2000}
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+# repeat LINE COUNT times into a script, after an optional setup script
+script() {
+  local name=$1 line=$2 count=$3 setup=${4:-}
+  {
+    [ -n "$setup" ] && printf '%s\n' "$setup"
+    for ((i = 0; i < count; i++)); do
+      printf '%s\n' "$line"
+    done
+  } > "$WORK/$name.sh"
+}
+
+# run a generated script and report its rate, subtracting the setup time
+run() {
+  local name=$1 count=$2 setupSeconds=${3:-0}
+  local start end
+  start=$(date +%s%N)
+  (cd "$WORK" && "$SHELL_BIN" "$WORK/$name.sh" > /dev/null 2>&1)
+  end=$(date +%s%N)
+  awk -v name="$name" -v ops="$count" -v ns="$((end - start))" -v setup="$setupSeconds" 'BEGIN {
+    seconds = ns / 1e9 - setup
+    if (seconds <= 0) seconds = 1e-9
+    printf "{\"bench\":\"%s\",\"ops\":%d,\"seconds\":%.3f,\"ops_per_sec\":%.1f}\n", name, ops, seconds, ops / seconds
+  }'
+}
+
+# time the setup alone, so it can be subtracted from the benchmark using it
+setupTime() {
+  local name=$1 setup=$2
+  script "$name-setup" "" 0 "$setup"
+  local start end
+  start=$(date +%s%N)
+  (cd "$WORK" && "$SHELL_BIN" "$WORK/$name-setup.sh" > /dev/null 2>&1)
+  end=$(date +%s%N)
+  awk -v ns="$((end - start))" 'BEGIN { printf "%.6f", ns / 1e9 }'
+}
+
+# launching external commands and built-ins
+script launch "/bin/true" "$COUNT"
+run launch "$COUNT"
+script true "true" "$COUNT"
+run true "$COUNT"
+script status "status" "$COUNT"
+run status "$COUNT"
+script cd "cd ." "$COUNT"
+run cd "$COUNT"
+
+# $$ expansion on long lines, through a built-in so no process is launched
+long="cd ."
+for ((i = 0; i < 200; i++)); do long+=" \$\$"; done
+script expand "$long" "$COUNT"
+run expand "$COUNT"
+
+# redirection of an external command and of a built-in
+script redirect "/bin/true < /dev/null > out" "$COUNT"
+run redirect "$COUNT"
+script redirect-builtin "echo x < /dev/null > out" "$COUNT"
+run redirect-builtin "$COUNT"
+
+# background launch and reap, with 1, 100 and 2000 jobs in the table
+for jobs in 1 100 2000; do
+  setup=""
+  for ((i = 1; i < jobs; i++)); do setup+="sleep 60 &"$'\n'; done
+  seconds=$(setupTime "background-$jobs" "$setup")
+  script "background-$jobs" "true &" "$COUNT" "$setup"
+  run "background-$jobs" "$COUNT" "$seconds"
+done
+
+# loop latency between lines with a full job table - reaping, reading and
+# dispatching a built-in. Built-ins are cheap, so run many more of them
+setup=""
+for ((i = 0; i < 2000; i++)); do setup+="sleep 60 &"$'\n'; done
+seconds=$(setupTime prompt "$setup")
+script prompt "status" "$((COUNT * 100))" "$setup"
+run prompt "$((COUNT * 100))" "$seconds"
+
+# exec to exit of smallsh itself with an empty script
+"$SHELL_BIN" --startup-bench "$COUNT"
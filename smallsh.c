@@ -13,82 +13,836 @@
  */
 
 /* IMPORTS */
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <ctype.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <string.h>
 #include <stdlib.h>
+#include <spawn.h>
+#include <sched.h>
 #include <signal.h>
 #include <unistd.h>
+#include <time.h>
+#include <dirent.h>
+#include <termios.h>
+#include <stdint.h>
 #include <stdbool.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/syscall.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <sys/types.h>
+#include <linux/mempolicy.h>
+#include <linux/sched.h>
 /* */
 
 /* CONSTANTS */
-#define MAX_ARGS 512
-#define MAX_LENGTH 2049
-char EXPAND = '$';
-char *COMMENT = "#";
-char *EXECUTE_BG = "&\0";
-char *CHANGE_DIR = "cd";
-char *STATUS = "status";
-char *BLANK_LINE = "\n";
-char *BLANK_SPACE = " ";
-char *EXIT_SHELL = "exit";
-char *REDIRECT_STDIN = "<";
-char *REDIRECT_STDOUT = ">";
-/* */
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 35)
+#define SPAWN_TCSETPGRP 1 // posix_spawn can hand the terminal to the child
+#else
+#define SPAWN_TCSETPGRP 0
+#endif
 
-/* GLOBAL STATE */
-bool shellActive;
-bool foregroundOnly = false;
+#if defined(SYS_pidfd_open) && defined(SYS_pidfd_send_signal)
+#define PIDFD_TRACKING 1 // pidfds can be requested, kernel support is probed at startup
+#else
+#define PIDFD_TRACKING 0
+#endif
 
-int currentProcess = 0; // global array index for inserting new processes
-int lastProcessStatus = 0;
-pid_t processes[MAX_LENGTH]; // keep track of background processes in a global array
+#if defined(SYS_clone3) && defined(CLONE_INTO_CGROUP)
+#define CGROUP_CLONE 1 // children can be cloned straight into a cgroup
+#else
+#define CGROUP_CLONE 0
+#endif
+
+#define ARENA_BLOCK_SIZE 65536   // minimum size of a command arena block
+#define STREAM_BUFFER_SIZE 65536 // stdio buffer size when not interactive
+const char EXPAND = '$';
+const char COMMENT[] = "#";
+const char EXIT_SHELL[] = "exit";
+const char PARALLEL_ARGS[] = ":::";
+const char TIME[] = "time";
+const char PIN[] = "pin";
+const char TRACE_OPTION[] = "trace";
+const char NOTIFY_OPTION[] = "notify";
+const char CGROUP_OPTION[] = "cgroups";
+const char DEFAULT_COPROCESS[] = "COPROC"; // name of a coprocess started without -n
+const char TRACE_VARIABLE[] = "SMALLSH_TRACE";  // enables tracing at startup, naming the trace file
+const char DEFAULT_TRACE_FILE[] = "smallsh.trace";
+#define TRACE_BUCKETS 64 // log2 nanosecond latency buckets per traced stage
+#define REDIRECT_FD_BASE 10 // descriptors opened for redirection are moved at or above this
+#define BUILTIN_INDEX_BITS 6 // the built-in index holds 1 << BUILTIN_INDEX_BITS entries
+#define NOTIFY_QUEUE_SIZE 64 // completion messages queued between drains, a power of two
+#define PLACEMENT_BITS 1024 // CPUs and NUMA nodes pin can name
+#define PARALLEL_MAX_STATUS 101 // exit value of parallel when over 100 jobs fail
+#define COPY_CHUNK_SIZE (16 << 20) // bytes cat moves per copy_file_range, sendfile or splice
+#define SERVE_EVENTS 64   // epoll events handled per wakeup of the server
+#define SERVE_LISTENER 0  // epoll tag of the listening socket
+#define SERVE_CHILDREN 1  // epoll tag of the SIGCHLD self-pipe
+#define SERVE_CLIENTS 2   // epoll tag of the first client slot, followed by the others
+const char HISTORY_VARIABLE[] = "HISTFILE"; // names the history file
+const char DEFAULT_HISTORY_FILE[] = ".smallsh_history"; // history file within HOME
+const char PROMPT[] = ": ";
+#define KEY_DELETE 0x100 // Delete key, decoded from its escape sequence
+const char DEFAULT_PATH[] = "/usr/local/bin:/usr/bin:/bin";
+const char BLANKS[] = " \t";
+const char WORD_DELIMITERS[] = " \t|&;<>'\"\\$"; // characters ending a run of plain word characters
+const char QUOTED_DELIMITERS[] = "\"\\$";     // same, within double quotes
 /* */
 
 /* STRUCTS */
 /**
- * @brief Command struct for encapsulating single commands. Captures raw CLI
- *        input into a line array, which is parsed into an array of pointers,
- *        args. Pointers are also initialized to keep track of input and output
- *        filenames, if provided, as well as a series of bools which determine
- *        the command's properties.
+ * @brief Ways the cat built-in copies between descriptors, cheapest first.
+ */
+typedef enum
+{
+  COPY_RANGE,    // copy_file_range, between regular files
+  COPY_SENDFILE, // sendfile, from a regular file
+  COPY_SPLICE,   // splice, to or from a pipe
+  COPY_READ      // read and write, for anything else
+} CopyMethod;
+
+/**
+ * @brief Block of memory owned by an arena. Allocations are bumped from data,
+ *        and blocks are chained when an allocation does not fit.
+ */
+typedef struct ArenaBlock
+{
+  struct ArenaBlock *next;
+  size_t size;
+  size_t used;
+  char data[] __attribute__((aligned(16)));
+} ArenaBlock;
+
+/**
+ * @brief Region allocator for everything belonging to a single command line.
+ *        Memory is handed out by bumping a pointer and released all at once
+ *        when the arena is reset before reading the next line.
  */
 typedef struct
 {
-  pid_t pid;
+  ArenaBlock *head; // block currently allocated from
+  size_t total;     // bytes allocated since the last reset
+} Arena;
+
+/**
+ * @brief Growable array of bytes allocated from the command arena.
+ */
+typedef struct
+{
+  char *data;
+  size_t length;
+  size_t capacity;
+} Buffer;
+
+/**
+ * @brief Environment index entry, pointing into a NAME=value string of the
+ *        environment. A NULL name marks an empty entry.
+ */
+typedef struct
+{
+  const char *name;
+  size_t nameLength;
+  const char *value;
+} EnvEntry;
+
+/**
+ * @brief Hashed snapshot of the environment used for variable expansion, so
+ *        that looking up a name does not scan environ. The snapshot is marked
+ *        stale whenever a built-in modifies the environment and rebuilt on the
+ *        next lookup.
+ */
+typedef struct
+{
+  EnvEntry *entries;
+  int bits; // entries holds 1 << bits entries
+  bool stale;
+} EnvIndex;
+
+/**
+ * @brief PATH cache entry mapping a command name to the executable found for
+ *        it, along with how many times it has been used. A NULL name marks an
+ *        empty entry.
+ */
+typedef struct
+{
+  char *name;
+  char *path;
+  int hits;
+} PathEntry;
+
+/**
+ * @brief Hash table caching where commands were found in PATH, so that each
+ *        launch does not search every PATH directory. Cleared whenever a
+ *        built-in changes PATH.
+ */
+typedef struct
+{
+  PathEntry *entries;
+  int bits; // entries holds 1 << bits entries, or 0 before first use
+  int count;
+} PathCache;
+
+/**
+ * @brief Kinds of redirection applied to a pipeline stage.
+ */
+typedef enum
+{
+  REDIRECT_READ,   // [n]<file
+  REDIRECT_WRITE,  // [n]>file
+  REDIRECT_APPEND, // [n]>>file
+  REDIRECT_DUP,    // [n]>&m or [n]<&m
+  REDIRECT_CLOSE,  // [n]>&- or [n]<&-
+  REDIRECT_STRING  // [n]<<<word
+} RedirectKind;
+
+/**
+ * @brief A single redirection of a stage, applied in the order written.
+ */
+typedef struct
+{
+  RedirectKind kind;
+  int fd;       // descriptor being redirected
+  int source;   // descriptor copied by REDIRECT_DUP
+  char *target; // filename, or the text of a here-string
+} Redirect;
+
+/**
+ * @brief Descriptor operation applied to a child before it runs - dup2 of
+ *        source onto fd, or close of fd when source is -1. Sources owned by
+ *        the parent were opened for the stage and are closed after launch.
+ */
+typedef struct
+{
+  int fd;
+  int source;
+  bool owned;
+} FdAction;
+
+/**
+ * @brief Stage struct for a single program within a pipeline, holding its
+ *        NULL terminated argv as produced by the parser, and its redirections.
+ */
+typedef struct
+{
+  char **argv;
+  int argc;
+  int capacity; // argv has room for capacity arguments plus the terminator
 
-  char *args[MAX_ARGS];
-  char line[MAX_LENGTH];
-  char *inputFile;
-  char *outputFile;
+  Redirect *redirects;
+  int redirectCount;
+  int redirectCapacity;
+} Stage;
+
+/**
+ * @brief How a command of a list is joined to the command following it.
+ */
+typedef enum
+{
+  LIST_END,    // last command of the line
+  LIST_ALWAYS, // ; or &, the next command always runs
+  LIST_AND,    // &&, the next command runs if this one succeeded
+  LIST_OR      // ||, the next command runs if this one failed
+} ListOperator;
 
-  bool redirectStdin;
-  bool redirectStdout;
+/**
+ * @brief Command struct for encapsulating single commands - the syntax tree
+ *        for one command of a line of CLI input. The command is parsed into
+ *        the stages of a pipeline, separated by pipe characters, and a bool
+ *        determines whether the pipeline runs in the background. Everything a
+ *        command points to is allocated from the command arena, and grows as
+ *        needed.
+ */
+typedef struct
+{
+  Stage *stages;
+  int stageCount;
   bool background;
+  ListOperator next; // operator ending the command
 } Command;
+
+/**
+ * @brief Built-in command, run within small shell by mapArguments.
+ */
+typedef struct
+{
+  const char *name;
+  void (*run)(char **argv);
+  bool external; // also a program in PATH, which runs in pipelines and the background
+} Builtin;
+
+/**
+ * @brief Resource limit shown and set by the ulimit built-in.
+ */
+typedef struct
+{
+  char option;      // option letter naming the limit
+  int resource;     // RLIMIT_ constant
+  const char *name; // description shown by ulimit -a
+  rlim_t unit;      // bytes, or seconds, per unit the limit is given in
+} Limit;
+
+/**
+ * @brief Where the processes of a command run, as given to the pin prefix -
+ *        the CPUs they may be scheduled on and the NUMA nodes their memory is
+ *        allocated from. Applied by each child between fork and exec.
+ */
+typedef struct
+{
+  unsigned long cpus[PLACEMENT_BITS / (8 * sizeof(unsigned long))];
+  unsigned long nodes[PLACEMENT_BITS / (8 * sizeof(unsigned long))];
+  bool pinCpus;   // cpus holds the only CPUs to run on
+  bool bindNodes; // nodes holds the only NUMA nodes to allocate from
+} Placement;
+
+/**
+ * @brief Stages of the shell's hot path timed in trace mode.
+ */
+typedef enum
+{
+  TRACE_READ,  // reading a line
+  TRACE_PARSE, // lexing, expansion and parsing
+  TRACE_SPAWN, // launching a stage with posix_spawn, up to its exec
+  TRACE_FORK,  // launching a stage with fork, up to the parent's return
+  TRACE_WAIT,  // waiting for a foreground pipeline
+  TRACE_STAGES
+} TraceStage;
+
+/**
+ * @brief Resources used by the processes of a pipeline, summed over every
+ *        process as it is reaped, except the max RSS which is the largest of any.
+ */
+typedef struct
+{
+  double real;   // wall clock seconds from launch until the last process was reaped
+  double user;   // user CPU seconds
+  double system; // system CPU seconds
+  long maxRss;   // kilobytes
+  long voluntarySwitches;
+  long involuntarySwitches;
+} Usage;
+
+/**
+ * @brief Completion of a background job, queued by the reaper until its
+ *        message is written.
+ */
+typedef struct
+{
+  pid_t pgid;
+  int status; // wait status of the last stage
+  Usage usage;
+} Notification;
+
+/**
+ * @brief Ring buffer of job completions waiting to be reported. Both counts
+ *        only grow, and are reduced modulo the queue size to index entries.
+ */
+typedef struct
+{
+  Notification entries[NOTIFY_QUEUE_SIZE];
+  unsigned queued;  // completions added
+  unsigned written; // completions reported
+} NotificationQueue;
+
+/**
+ * @brief Process struct for a single process of a background pipeline.
+ */
+typedef struct
+{
+  pid_t pid;
+  int pidfd; // pidfd referring to the process, or -1 without pidfd support
+  bool reaped;
+} Process;
+
+/**
+ * @brief Job struct for tracking a background pipeline, whose processes share
+ *        the process group pgid. Jobs live in a growable slab indexed by
+ *        job id - 1, where inactive slots are chained into a free list and
+ *        active slots into a doubly linked live list, so that insertion,
+ *        removal and iteration over running jobs never touch free slots.
+ */
+typedef struct
+{
+  int id;
+  pid_t pgid;
+  Process *processes; // processes of the pipeline, in stage order
+  int processCount;
+  int running;        // processes which have not been reaped yet
+  int status;         // wait status of the last stage
+  bool active;
+  bool stopped;       // stopped by a signal, until continued by fg or bg
+  bool foreground;    // being waited for by fg, so its completion is not reported
+  bool modesSaved;    // modes holds the terminal settings the job stopped with
+  struct termios modes;
+  int cgroupFd;            // directory descriptor of the job's cgroup, or -1
+  int cgroupId;            // number naming the job's cgroup within the session
+  int client;              // server client which sent the job, or -1
+  uint32_t line;           // line of the client's connection which the job ran
+  char *command;           // text of the pipeline, for the jobs built-in
+  struct timespec started; // CLOCK_MONOTONIC time the job was launched
+  Usage usage;             // resources used by the processes reaped so far
+
+  int prev; // live list link (unused while free)
+  int next; // live list link, or free list link while inactive
+} Job;
+
+/**
+ * @brief State of a running parallel built-in - the pids of its running
+ *        children, one slot per worker, along with the aggregated results of
+ *        those which have been reaped.
+ */
+typedef struct
+{
+  pid_t *pids; // running children, with 0 marking a free worker
+  int workers;
+  int running;
+  int failures;     // jobs which exited abnormally
+  bool interrupted; // a job was terminated by SIGINT - launch no more
+} ParallelRun;
+
+/**
+ * @brief How reading a line with the line editor ended.
+ */
+typedef enum
+{
+  EDIT_PENDING,   // the line is still being edited
+  EDIT_ACCEPT,    // Enter was pressed
+  EDIT_INTERRUPT, // Ctrl-C discarded the line
+  EDIT_EOF        // Ctrl-D on an empty line, or the terminal went away
+} EditResult;
+
+/**
+ * @brief State of the line editor while a line is typed at the prompt. The
+ *        line itself is edited in place within inputLine, and compared with
+ *        the line as last drawn to work out what to redraw.
+ */
+typedef struct
+{
+  bool active;          // a line is being edited at the prompt
+  struct termios saved; // terminal settings restored once the line is read
+  size_t length;        // bytes of inputLine typed so far
+  size_t cursor;        // offset of the cursor within inputLine
+  char *shown;          // line as last drawn after the prompt
+  size_t shownLength;
+  size_t shownCursor;
+  size_t shownCapacity;
+  int entries;          // history entries when the line was started
+  int recalled;         // history entry being edited, or entries for the typed line
+  char *draft;          // line typed before history was recalled
+  size_t draftLength;
+  bool lastKeyTab;      // the previous key was Tab, so another lists candidates
+  EditResult result;
+  Buffer output;        // output queued until the batch of keys has been applied
+} LineEditor;
+
+/**
+ * @brief Command history, shared between shells through an append-only file.
+ *        The file is mapped read-only and indexed lazily - entries are only
+ *        found when a lookup first needs them, and then only among the bytes
+ *        appended since the last lookup. Entries are also chained by their
+ *        first byte, newest first, so that a !prefix lookup only compares
+ *        entries which could match.
+ */
+typedef struct
+{
+  int fd;          // history file, opened for appending, or -1 without history
+  char *map;       // read-only shared mapping of the file, or NULL
+  size_t mapped;   // bytes of the file mapped
+  size_t indexed;  // bytes of the mapping split into entries
+  size_t *offsets; // start of each entry within the file
+  int *sameFirst;  // 1 + previous entry starting with the same byte, or 0
+  int latest[256]; // 1 + newest entry starting with each byte, or 0
+  int count;
+  int capacity;
+} History;
+
+/**
+ * @brief Open addressing hash table entry mapping a pid to its job's slot.
+ *        A pid of 0 marks an empty entry.
+ */
+typedef struct
+{
+  pid_t pid;
+  int slot;
+} JobIndexEntry;
+
+/**
+ * @brief Global job table - active jobs, the pid index and their bookkeeping.
+ *        Both arrays are released once the last job is removed.
+ */
+typedef struct
+{
+  Job *jobs;
+  int capacity;
+  int count;
+  int processCount; // unreaped processes indexed by pid
+  int freeList;     // first free slot, or -1
+  int liveList;     // first active slot, or -1
+
+  JobIndexEntry *index;
+  int indexBits; // index holds 1 << indexBits entries
+} JobTable;
+
+/**
+ * @brief Session cgroup, created by set -o cgroups beneath small shell's own
+ *        cgroup v2 group, holding a child cgroup per background job.
+ */
+typedef struct
+{
+  int fd;       // directory descriptor of the session cgroup, or -1
+  char *path;   // path of the session cgroup
+  int jobs;     // job cgroups created so far, numbering the next
+  bool enabled; // background jobs are launched into cgroups of their own
+} CgroupSession;
+
+/**
+ * @brief Coprocess started by the coproc built-in - a background job whose
+ *        stdin and stdout are pipes held by small shell. Output read past the
+ *        end of a line is kept in pending, between start and end.
+ */
+typedef struct
+{
+  char *name;
+  pid_t pid;
+  int input;  // write end of the pipe to the coprocess's stdin
+  int output; // read end of the pipe from the coprocess's stdout
+  char *pending;
+  size_t start;
+  size_t end;
+  size_t capacity;
+} Coprocess;
+
+/**
+ * @brief Record sent by smallsh --serve to a client as each of its jobs
+ *        finishes, or straight away for a line which couldn't be launched.
+ *        Fields are in host byte order, and size leads so that clients can
+ *        step over fields added later.
+ */
+typedef struct
+{
+  uint32_t size;       // bytes in the record, this field included
+  uint32_t line;       // line of the connection the command was read from, from 1
+  int32_t pid;         // process group of the job, or 0 if it wasn't launched
+  int32_t status;      // exit value, or 128 plus the signal which terminated the job
+  uint64_t realUsec;   // wall clock time from launch until the job was reaped
+  uint64_t userUsec;   // user CPU time
+  uint64_t systemUsec; // system CPU time
+  int64_t maxRss;      // kilobytes
+  int64_t voluntarySwitches;
+  int64_t involuntarySwitches;
+} ServeRecord;
+
+/**
+ * @brief Connection to smallsh --serve. Lines are read into input and
+ *        launched as they complete, while records wait in output until the
+ *        socket accepts them.
+ */
+typedef struct
+{
+  int fd;         // socket of the connection, or -1 once closed
+  bool active;    // the slot is in use
+  bool reading;   // more lines may arrive
+  bool writing;   // waiting for the socket to accept the pending records
+  int running;    // jobs launched which have not finished
+  uint32_t lines; // lines received so far
+  char *input;
+  size_t inputLength;
+  size_t inputCapacity;
+  char *output;
+  size_t outputLength;
+  size_t outputCapacity;
+} Client;
+/* */
+
+/* GLOBAL STATE */
+bool shellActive;
+bool foregroundOnly = false;
+volatile sig_atomic_t foregroundToggles = 0; // SIGTSTPs received by the handler
+volatile sig_atomic_t waitInterrupted = 0;   // SIGINT received during the wait built-in
+sig_atomic_t handledToggles = 0;             // SIGTSTPs applied by the program loop
+bool interactive; // input is a terminal - prompt and flush output eagerly
+bool terminal;    // stdin is the terminal small shell controls, enabling job control
+struct termios shellModes; // terminal settings restored when a job stops
+
+FILE *inputStream; // stream commands are read from, stdin or a script
+char *inputLine;   // raw input, reused and grown by getline for every line
+size_t inputCapacity;
+
+Arena commandArena = {NULL, 0}; // memory for the command being run, reset per line
+
+int lastProcessStatus = 0;
+int lastSignal = 0; // signal which terminated the last foreground pipeline, or 0
+Usage lastUsage;    // resources used by the last foreground pipeline
+
+NotificationQueue notifications;    // finished jobs not reported yet
+bool notifyImmediately = false; // report finished jobs during foreground commands, see set -b
+
+bool tracing = false; // time each stage of the hot path, see set -o trace
+FILE *traceFile;      // JSON lines trace records
+struct timespec traceEpoch;
+uint64_t traceHistogram[TRACE_STAGES][TRACE_BUCKETS];
+const char *const TRACE_NAMES[TRACE_STAGES] = {"read", "parse", "spawn", "fork", "wait"};
+
+int builtinIndex[1 << BUILTIN_INDEX_BITS]; // open addressing, 1 + index into BUILTINS or 0
+JobTable jobTable = {NULL, 0, 0, 0, -1, -1, NULL, 0}; // background processes
+
+EnvIndex envIndex = {NULL, 0, true}; // snapshot of the environment
+LineEditor editor;      // line typed at the prompt
+bool lineEditing = false; // read lines with the line editor
+History history = {-1, NULL, 0, 0, NULL, NULL, {0}, 0, 0}; // commands typed at the prompt
+PathCache pathCache = {NULL, 0, 0};  // resolved command paths
+pid_t lastBackgroundPid = 0;         // pid of the last background process, for $!
+
+char shellPid[16];     // pid of small shell, formatted once at startup for $$
+size_t shellPidLength;
+int childPipe[2];            // self-pipe written to by the SIGCHLD handler
+ParallelRun *parallelRun = NULL; // parallel built-in currently running, if any
+bool forkOnly = false;       // launch every stage with fork instead of posix_spawn
+const Placement *placement = NULL; // placement of the command run by pin, if any
+struct rlimit commandLimits[RLIMIT_NLIMITS]; // limits set by ulimit, by resource
+unsigned commandLimitMask = 0; // resources of commandLimits applied to commands
+bool pidfdSupported = false; // kernel supports pidfd_open and pidfd_send_signal
+int eventFd = -1;            // epoll instance waited on at the prompt, or -1
+CgroupSession cgroupSession = {-1, NULL, 0, false}; // see set -o cgroups
+int launchCgroup = -1;       // cgroup the pipeline being launched joins, or -1
+Coprocess *coprocesses = NULL; // running coprocesses, see coproc
+int coprocessCount = 0;
+int coprocessCapacity = 0;
+int serverFd = -1;           // epoll instance of smallsh --serve, or -1
+Client *clients = NULL;      // connections to smallsh --serve, by slot
+int clientCapacity = 0;
+int launchClient = -1;       // client the pipeline being launched came from, or -1
+uint32_t launchLine;         // line of the client's connection it came from
 /* */
 
 /* FUNCTION PROTOTYPES */
-void status();
-void tokenize();
+void status(char **argv);
+void setOptions(char **argv);
+void startTrace(const char *path);
+void stopTrace();
+void traceMark(struct timespec *mark);
+void traceStage(TraceStage stage, struct timespec *mark);
+void addUsage(Usage *usage, const struct rusage *rusage);
+void printUsage(FILE *stream, const Usage *usage);
+void queueNotification(pid_t pgid, int status, const Usage *usage);
+void drainNotifications();
 void exitSmallsh();
-void executeProgram();
+bool executeProgram(Command *cmd);
+void abandonStages(Command *cmd, pid_t pgid, const pid_t *pids, int count);
+void waitForeground(Command *cmd, pid_t pgid, pid_t *pids, int count, pid_t last,
+                    const struct timespec *started);
+void suspendJob(Job *job);
+void runStage(Command *cmd, int index, pid_t pgid, const char *path, FdAction *actions, int count);
+void closeRedirects(FdAction *actions, int count);
+void addRedirect(Stage *stage, RedirectKind kind, int fd, int source, char *target);
+void spawnBenchmark(int count, int ballast);
+void startupBenchmark(int count);
+void addClient(int fd);
+void readClient(int slot);
+void serveLine(int slot, const char *line);
+void serveRecord(int slot, uint32_t line, pid_t pgid, int status, const Usage *usage);
+void flushClient(int slot);
+void watchClient(int slot);
+void dropClient(int slot);
+void finishClient(int slot);
+void flushOutput();
 void parseCommandLine();
-void foregroundOnlyMode();
+void foregroundOnlyMode(int signo);
+void checkForegroundMode();
+void announceForegroundMode();
+void foregroundJob(char **argv);
+void backgroundJob(char **argv);
+void toggleForegroundOnly(char **argv);
+void setLimits(char **argv);
+void cgroupCommand(char **argv);
+void stopCgroupSession();
+void removeJobCgroup(Job *job);
+void startCoprocess(char **argv);
+void sendCoprocess(char **argv);
+void readCoprocess(char **argv);
+void closeCoprocess(char **argv);
+void applyPlacement(const Placement *place);
+void applyLimits();
+void resetChildSignals(bool background, bool shellGroup);
+void reapChildren();
+void reapProcess(pid_t pid, int status, const struct rusage *rusage);
+void listJobs(char **argv);
+void changeDirectory(char **argv);
+void echoArguments(char **argv);
+void succeed(char **argv);
+void fail(char **argv);
+void testExpression(char **argv);
+void printDirectory(char **argv);
+void printFormatted(char **argv);
+void catFiles(char **argv);
+void buildBuiltinIndex();
+void runBuiltin(Command *cmd, const Builtin *builtin);
+void waitJobs(char **argv);
+void interruptWait(int signo);
+void beginInterruptibleWait(struct sigaction *previous);
+void endInterruptibleWait(const struct sigaction *previous);
+void waitForChild();
 void checkProcessStatus();
-void checkBackgroundProcess();
-void killBackgroundProcesses();
-void checkVariableExpansion(Command *cmd);
+void runParallel(char **argv);
+void reapParallel(pid_t pid, int status);
+void handleChildSignal(int signo);
+void initChildTracking();
+void killJob(Job *job);
+void addArgument(Stage *stage, char *word);
+void resetArena(Arena *arena);
+void appendBuffer(Buffer *buffer, const char *data, size_t length);
+
+void removeJob(Job *job);
+void indexJob(pid_t pid, int slot);
+void unindexJob(pid_t pid);
+void growJobTable();
+void growJobIndex();
+
+void buildEnvIndex();
+void hashCommands(char **argv);
+void listHistory(char **argv);
+void openHistory();
+void addHistory(const char *line, size_t length);
+void reserveLine(size_t length);
+void insertLine(const char *text, size_t length);
+void eraseLine(size_t from, size_t to);
+void replaceLine(const char *text, size_t length);
+void moveCursor(const char *text, size_t length, bool right);
+void refreshLine();
+void redrawLine();
+void flushEditor();
+void recallHistory(int step);
+void completeWord(bool list);
+void addDirectoryNames(const char *path, const char *prefix, size_t length, bool executables, Buffer *names);
+void clearPathCache();
+void forgetCommand(const char *name);
+void cacheCommand(char *name, char *path);
+void exportVariables(char **argv);
+void unsetVariables(char **argv);
 
 int cd(char *path);
+bool drainChildPipe();
+bool waitForInput();
+int openPidfd(pid_t pid);
+int openRedirects(Command *cmd, int index, int inFd, int outFd, FdAction **actions);
+int openRedirect(const Redirect *redirect);
+int parseRedirect(const char **input, Stage *stage);
+unsigned envHash(const char *name, size_t length);
+ssize_t editLine();
+size_t editKey(const char *keys, size_t count);
+size_t previousChar(size_t offset);
+size_t nextChar(size_t offset);
+size_t textColumns(const char *text, size_t length);
+int compareNames(const void *a, const void *b);
+int compareLatencies(const void *a, const void *b);
+int serveConnections(const char *path);
+int syncHistory();
+int findHistory(const char *prefix, size_t length);
+int searchHistory(const char *text, size_t length, int from);
+const char *historyEntry(int index, size_t *length);
+char *expandHistory(const char *line, bool *expanded);
+const char *resolveCommand(const char *name, bool *cached);
+PathEntry *findCommand(const char *name);
+const char *lookupVariable(const char *name, size_t length);
+void expandVariable(const char **input, Buffer *out);
+void *allocate(Arena *arena, size_t size);
+void *reallocate(Arena *arena, void *data, size_t size, size_t newSize);
+unsigned jobHash(pid_t pid);
+Job *addJob(pid_t pgid, pid_t *pids, int count, const char *command);
+Job *lookupJob(const char *spec);
+Job *oldestJob(bool running);
+Job *currentJob(bool stopped);
+int waitJob(Job *job, bool foreground);
+char *describeCommand(Command *cmd);
+Job *findJob(pid_t pid);
+pid_t forkStage(Command *cmd, int index, int inFd, int outFd, pid_t pgid);
+pid_t spawnStage(Command *cmd, int index, int inFd, int outFd, pid_t pgid);
 int mapArguments(Command *cmd);
-int parseArguments(Command *cmd);
+int timeCommand(Command *cmd);
+int pinCommand(Command *cmd);
+bool parsePlacement(Stage *stage, Placement *place);
+bool parseNumberList(const char *list, unsigned long *mask);
+const Limit *findLimit(char option);
+bool getCommandLimit(int resource, struct rlimit *limit);
+bool startCgroupSession();
+int createJobCgroup(int *id);
+pid_t forkIntoCgroup(int cgroupFd);
+bool readCgroupFile(int fd, const char *name, char *text, size_t size);
+bool writeCgroupFile(int fd, const char *name, const char *value);
+long long cgroupCounter(const char *text, const char *key);
+int coprocessOption(char **argv, const char **name);
+Coprocess *findCoprocess(const char *name);
+int exitCode(int status);
+double elapsedSince(const struct timespec *start);
+int parseLine(const char **input, Command *cmd);
+int lexWord(const char **input, Buffer *out, bool split);
+char *nextWord(char *words, char *end);
+Stage *addStage(Command *cmd, int *capacity);
+const Builtin *findBuiltin(const char *name);
+int evaluateTest(char **args, int count);
+const char *printEscape(const char *p);
+bool copyDescriptor(int in, mode_t inMode, int out, mode_t outMode);
+CopyMethod nextCopyMethod(CopyMethod method, mode_t inMode, mode_t outMode);
 /* */
 
-int main(void)
+/* BUILT-INS */
+const Builtin BUILTINS[] = {
+    {"cd", changeDirectory, false},
+    {"status", status, false},
+    {"set", setOptions, false},
+    {"export", exportVariables, false},
+    {"unset", unsetVariables, false},
+    {"hash", hashCommands, false},
+    {"parallel", runParallel, false},
+    {"jobs", listJobs, false},
+    {"wait", waitJobs, false},
+    {"fg", foregroundJob, false},
+    {"bg", backgroundJob, false},
+    {"fgonly", toggleForegroundOnly, false},
+    {"ulimit", setLimits, false},
+    {"cgroup", cgroupCommand, false},
+    {"coproc", startCoprocess, false},
+    {"cosend", sendCoprocess, false},
+    {"coread", readCoprocess, false},
+    {"coclose", closeCoprocess, false},
+    {"history", listHistory, false},
+    {"echo", echoArguments, true},
+    {"true", succeed, true},
+    {"false", fail, true},
+    {"test", testExpression, true},
+    {"[", testExpression, true},
+    {"pwd", printDirectory, true},
+    {"printf", printFormatted, true},
+    {"cat", catFiles, true},
+};
+#define BUILTIN_COUNT (int)(sizeof(BUILTINS) / sizeof(BUILTINS[0]))
+
+const Limit LIMITS[] = {
+    {'c', RLIMIT_CORE, "core file size (blocks)", 512},
+    {'d', RLIMIT_DATA, "data seg size (kbytes)", 1024},
+    {'f', RLIMIT_FSIZE, "file size (blocks)", 512},
+    {'l', RLIMIT_MEMLOCK, "max locked memory (kbytes)", 1024},
+    {'m', RLIMIT_RSS, "max memory size (kbytes)", 1024},
+    {'n', RLIMIT_NOFILE, "open files", 1},
+    {'s', RLIMIT_STACK, "stack size (kbytes)", 1024},
+    {'t', RLIMIT_CPU, "cpu time (seconds)", 1},
+    {'u', RLIMIT_NPROC, "max user processes", 1},
+    {'v', RLIMIT_AS, "virtual memory (kbytes)", 1024},
+};
+#define LIMIT_COUNT (int)(sizeof(LIMITS) / sizeof(LIMITS[0]))
+/* */
+
+int main(int argc, char *argv[])
 {
   // Initialize an empty SIGINT_action struct and register a signal ignore
   // constant instead of a handler function, and block catchable signals
@@ -98,6 +852,113 @@ int main(void)
   sigfillset(&SIGINT_action.sa_mask);
   sigaction(SIGINT, &SIGINT_action, NULL);
 
+  // Create a non-blocking self-pipe and register a SIGCHLD handler which writes
+  // to it, so that background processes are only reaped when one has exited
+  if (pipe2(childPipe, O_NONBLOCK | O_CLOEXEC) == -1)
+  {
+    perror("Error creating pipe");
+    exit(1);
+  }
+  struct sigaction SIGCHLD_action = {0};
+  SIGCHLD_action.sa_handler = handleChildSignal;
+  sigfillset(&SIGCHLD_action.sa_mask);
+  SIGCHLD_action.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+  sigaction(SIGCHLD, &SIGCHLD_action, NULL);
+
+  // Ignore SIGTTOU so small shell can hand the terminal to a foreground
+  // pipeline's process group and take it back afterwards
+  struct sigaction SIGTTOU_action = {0};
+  SIGTTOU_action.sa_handler = SIG_IGN;
+  sigaction(SIGTTOU, &SIGTTOU_action, NULL);
+
+  // Format the pid of small shell once for $$ expansion
+  shellPidLength = snprintf(shellPid, sizeof(shellPid), "%d", getpid());
+
+  // Compare the fork and posix_spawn launch paths instead of running the shell
+  if (argc > 1 && strcmp(argv[1], "--spawn-bench") == 0)
+  {
+    spawnBenchmark(argc > 2 ? atoi(argv[2]) : 1000, argc > 3 ? atoi(argv[3]) : 0);
+    return 0;
+  }
+
+  // Time small shell's own exec to exit instead of running the shell
+  if (argc > 1 && strcmp(argv[1], "--startup-bench") == 0)
+  {
+    startupBenchmark(argc > 2 ? atoi(argv[2]) : 1000);
+    return 0;
+  }
+
+  // Serve command lines over a Unix socket instead of reading them
+  if (argc > 1 && strcmp(argv[1], "--serve") == 0)
+  {
+    if (argc != 3)
+    {
+      fprintf(stderr, "usage: smallsh --serve socket\n");
+      return 1;
+    }
+    initChildTracking();
+    buildBuiltinIndex();
+    return serveConnections(argv[2]);
+  }
+
+  // Read commands from a script if one is given, otherwise from stdin
+  inputStream = stdin;
+  if (argc > 1)
+  {
+    inputStream = fopen(argv[1], "re");
+    if (!inputStream)
+    {
+      perror(argv[1]);
+      return 1;
+    }
+  }
+
+  // When not reading from a terminal, suppress the prompt and read and write
+  // through large buffers, only flushing output before launching programs
+  interactive = isatty(fileno(inputStream));
+  terminal = isatty(STDIN_FILENO) && tcgetpgrp(STDIN_FILENO) == getpgrp();
+  if (!interactive)
+  {
+    setvbuf(inputStream, NULL, _IOFBF, STREAM_BUFFER_SIZE);
+    setvbuf(stdout, NULL, _IOFBF, STREAM_BUFFER_SIZE);
+  }
+
+  // Setup signal handler from SIGTSTP to enter/exit foreground only mode. When
+  // interactive, reading a line is interrupted so the mode change can be
+  // announced straight away, otherwise interrupted calls are restarted. With
+  // job control, Ctrl-Z stops the foreground job instead, small shell ignores
+  // SIGTSTP, and the fgonly built-in toggles the mode
+  // adapted from Exploration 5: Signal Handling API
+  struct sigaction SIGTSTP_action = {0};
+  SIGTSTP_action.sa_handler = terminal ? SIG_IGN : foregroundOnlyMode;
+  sigfillset(&SIGTSTP_action.sa_mask);
+  SIGTSTP_action.sa_flags = interactive ? 0 : SA_RESTART;
+  sigaction(SIGTSTP, &SIGTSTP_action, NULL);
+  if (terminal)
+  {
+    tcgetattr(STDIN_FILENO, &shellModes);
+  }
+
+  // Track background processes with pidfds where the kernel supports them
+  initChildTracking();
+  buildBuiltinIndex();
+  if (interactive)
+  {
+    openHistory();
+  }
+
+  // Edit lines typed at the terminal small shell controls, unless it can't
+  // position the cursor
+  const char *term = getenv("TERM");
+  lineEditing = terminal && inputStream == stdin && !(term && strcmp(term, "dumb") == 0) &&
+                tcgetattr(STDIN_FILENO, &editor.saved) == 0;
+
+  // Trace the hot path from the first line when asked to by the environment
+  if (getenv(TRACE_VARIABLE))
+  {
+    startTrace(getenv(TRACE_VARIABLE));
+  }
+
   // Initialize smallsh program loop
   shellActive = true;
   parseCommandLine();
@@ -109,483 +970,6540 @@ int main(void)
  * @brief Small Shell's program loop. Smallsh will first check the status of
  *        processes running in the background, in order to post updates regarding
  *        their exit status. The program then reads raw input from the command line,
- *        parses it, stores it into a command struct, and then passes the parsed
- *        user arguments to the mapArguments function which determines whether
- *        the user passed in a built-in command or not.
+ *        or a script, parses it, stores it into a command struct, and then passes
+ *        the parsed user arguments to the mapArguments function which determines
+ *        whether the user passed in a built-in command or not. The prompt is only
+ *        printed when reading from a terminal, and the end of input exits smallsh.
+ */
+void parseCommandLine()
+{
+  while (shellActive)
+  {
+
+    checkProcessStatus();
+    drainNotifications();
+    checkForegroundMode();
+    if (interactive)
+    {
+      printf("%s", PROMPT);
+      fflush(stdout);
+    }
+
+    // Reap background jobs while waiting for the next line to be typed, which
+    // the line editor does between keys
+    if (interactive && !lineEditing && !waitForInput())
+    {
+      continue;
+    }
+
+    // Release the previous command and read raw CLI input of any length
+    resetArena(&commandArena);
+    Command cmd = {0};
+    struct timespec mark;
+    traceMark(&mark);
+    ssize_t length = lineEditing ? editLine() : getline(&inputLine, &inputCapacity, inputStream);
+    if (length == -1 && errno == EINTR && (lineEditing || ferror(inputStream)))
+    {
+      // interrupted by SIGTSTP or Ctrl-C at the prompt - announce the mode and reprompt
+      clearerr(inputStream);
+      continue;
+    }
+    if (length == -1)
+    {
+      shellActive = false;
+      exitSmallsh();
+    }
+    traceStage(TRACE_READ, &mark);
+    if (length > 0 && inputLine[length - 1] == '\n')
+    {
+      inputLine[--length] = '\0';
+    }
+    const char *input = inputLine;
+
+    // Expand history references typed at the prompt, echoing the command
+    // they expand to, and record every line with something on it
+    if (interactive)
+    {
+      bool expanded = false;
+      if (strchr(input, '!') && !(input = expandHistory(input, &expanded)))
+      {
+        lastProcessStatus = 1;
+        continue;
+      }
+      if (expanded)
+      {
+        printf("%s\n", input);
+      }
+      if (input[strspn(input, BLANKS)])
+      {
+        addHistory(input, strlen(input));
+      }
+    }
+
+    // Ignore comments/blank-lines
+    if (strncmp(input, COMMENT, 1) == 0)
+    {
+      continue;
+    }
+
+    // Lex and parse raw CLI input in a single pass, expanding variables, into
+    // the command struct. Pass it to a handler function which determines
+    // whether to execute a built-in or non-built-in function. A list is parsed
+    // one command at a time, so that variables such as $? are expanded after
+    // the commands before them have run
+    bool run = true;
+    while (true)
+    {
+      int parsed = parseLine(&input, &cmd);
+      traceStage(TRACE_PARSE, &mark);
+      if (parsed == -1)
+      {
+        lastProcessStatus = 1;
+        break;
+      }
+      if (run && mapArguments(&cmd))
+      {
+        shellActive = false;
+        exitSmallsh();
+      }
+      if (cmd.next == LIST_END)
+      {
+        break;
+      }
+
+      // skipped commands leave the status alone, so a || b && c runs c if a succeeds
+      run = cmd.next == LIST_ALWAYS || (cmd.next == LIST_AND) == (lastProcessStatus == 0);
+      traceMark(&mark);
+    }
+  }
+}
+
+/**
+ * @brief Checks the status of processes running in the background before each
+ *        iteration of the shell loop. The SIGCHLD handler writes a byte to
+ *        the self-pipe whenever a child changes state - if the pipe is empty,
+ *        no child has exited and nothing is done. Otherwise, finished children
+ *        are reaped.
+ */
+void checkProcessStatus()
+{
+  if (drainChildPipe())
+  {
+    reapChildren();
+  }
+}
+
+/**
+ * @brief Drains the self-pipe written to by the SIGCHLD handler.
+ *
+ * @return bool - whether any child has changed state since the last drain
+ */
+bool drainChildPipe()
+{
+  char drain[64];
+  bool signalled = false;
+  while (read(childPipe[0], drain, sizeof(drain)) > 0)
+  {
+    signalled = true;
+  }
+  return signalled;
+}
+
+/**
+ * @brief Blocks until a child changes state, by waiting for the SIGCHLD
+ *        handler to write to the self-pipe, then reaps finished children.
+ */
+void waitForChild()
+{
+  struct pollfd pipeFd = {childPipe[0], POLLIN, 0};
+  while (poll(&pipeFd, 1, -1) == -1 && errno == EINTR)
+  {
+  }
+  checkProcessStatus();
+}
+
+/**
+ * @brief Reaps every child which has exited with a single waitpid(-1) drain.
+ *        Background jobs that have exited or been terminated by a signal are
+ *        queued to be reported before the next prompt.
+ *        Children of a running parallel built-in are handed back to it.
+ */
+void reapChildren()
+{
+  // reap every child which has exited, reporting the status of background
+  // processes that have exited or been terminated. Adapted from Module 4:
+  // Process API - Monitoring Child Processes
+  int status;
+  struct rusage rusage;
+  pid_t pid;
+  while ((pid = wait4(-1, &status, WNOHANG, &rusage)) > 0)
+  {
+    reapProcess(pid, status, &rusage);
+  }
+}
+
+/**
+ * @brief Records a reaped child in the job it belongs to. Once every process
+ *        of a background job has finished, its completion is queued to be
+ *        reported and the job is removed. A job finishing under fg is instead
+ *        reported like a foreground pipeline. Children which are not jobs are handed to a running
+ *        parallel built-in.
+ *
+ * @param pid pid of the reaped child
+ * @param status wait status of the child
+ * @param rusage resources used by the child
+ */
+void reapProcess(pid_t pid, int status, const struct rusage *rusage)
+{
+  // find the process in the job table, keeping the status of the last stage
+  Job *job = findJob(pid);
+  if (!job)
+  {
+    reapParallel(pid, status);
+    return;
+  }
+  for (int i = 0; i < job->processCount; i++)
+  {
+    if (job->processes[i].pid == pid)
+    {
+      job->processes[i].reaped = true;
+      close(job->processes[i].pidfd);
+      job->processes[i].pidfd = -1;
+      job->status = i == job->processCount - 1 ? status : job->status;
+    }
+  }
+  addUsage(&job->usage, rusage);
+  unindexJob(pid);
+  if (--job->running > 0)
+  {
+    return;
+  }
+
+  // every process of the pipeline has finished - report it by its pgid
+  pid = job->pgid;
+  status = job->status;
+  Usage usage = job->usage;
+  usage.real = elapsedSince(&job->started);
+  bool foreground = job->foreground;
+  int client = job->client;
+  uint32_t line = job->line;
+  removeJob(job);
+  if (client != -1)
+  {
+    serveRecord(client, line, pid, exitCode(status), &usage);
+    return;
+  }
+  if (!foreground)
+  {
+    queueNotification(pid, status, &usage);
+    return;
+  }
+
+  // a job brought into the foreground by fg finishes like a foreground pipeline
+  lastUsage = usage;
+  lastSignal = WIFSIGNALED(status) ? WTERMSIG(status) : 0;
+  if (lastSignal)
+  {
+    printf("terminated by signal %d\n", lastSignal);
+    flushOutput();
+  }
+}
+
+/**
+ * @brief SIGCHLD handler. Writes a byte to the self-pipe so the program loop
+ *        knows to reap children, preserving errno for the interrupted code.
+ *
+ * @param signo signal number (unused)
+ */
+void handleChildSignal(int signo)
+{
+  (void)signo;
+  int savedErrno = errno;
+  write(childPipe[1], "", 1);
+  errno = savedErrno;
+}
+
+/**
+ * @brief Expands the variable starting at an expansion character. $$ expands
+ *        into the pid of small shell, cached at startup, $? into the exit value
+ *        of the last foreground process and $! into the pid of the last
+ *        background process. $NAME and ${NAME} expand into the value of an
+ *        environment variable, or nothing if it is unset. An expansion
+ *        character which does not start a variable is copied as-is.
+ *
+ * @param input pointer to the expansion character, advanced past the variable
+ * @param out buffer to append the expansion to
+ */
+void expandVariable(const char **input, Buffer *out)
+{
+  const char *start = *input + 1;
+  const char *value = "";
+  size_t length = 0;
+  char number[16];
+
+  switch (*start)
+  {
+  case '$':
+    value = shellPid;
+    length = shellPidLength;
+    *input += 2;
+    break;
+  case '?':
+    value = number;
+    length = snprintf(number, sizeof(number), "%d", lastProcessStatus);
+    *input += 2;
+    break;
+  case '!':
+    if (lastBackgroundPid)
+    {
+      value = number;
+      length = snprintf(number, sizeof(number), "%d", lastBackgroundPid);
+    }
+    *input += 2;
+    break;
+  default:
+  {
+    // a name starts with a letter or underscore, optionally enclosed in braces
+    bool braced = *start == '{';
+    const char *name = start + braced;
+    const char *nameEnd = name;
+    if (isalpha((unsigned char)*nameEnd) || *nameEnd == '_')
+    {
+      while (isalnum((unsigned char)*nameEnd) || *nameEnd == '_')
+      {
+        nameEnd++;
+      }
+    }
+    if (nameEnd == name || (braced && *nameEnd != '}'))
+    {
+      value = *input;
+      length = 1;
+      *input += 1;
+      break;
+    }
+
+    value = lookupVariable(name, nameEnd - name);
+    length = value ? strlen(value) : 0;
+    *input = nameEnd + braced;
+    break;
+  }
+  }
+
+  appendBuffer(out, value, length);
+}
+
+/**
+ * @brief Maps parsed user input into commands to be executed by small shell.
+ *        Null, blank space, or blank lines will lead to a reprompt. Exit will
+ *        simply return 1, which is handled in the caller function. Built-ins
+ *        are looked up in a hash table and run in small shell. Finally, any non
+ *        built-in functions will be passed to the executeProgram function which
+ *        handles that case.
+ *
+ * @param cmd command struct containing parsed input
+ * @return int 1 - in case of exit, else 0
+ */
+int mapArguments(Command *cmd)
+{
+  // pull the first argument in parsed input to decide what execution path to take
+  char *arg = cmd->stages[0].argv[0];
+
+  // if there are no arguments, such as for a blank line, print a newline and reprompt
+  if (!arg)
+  {
+    if (interactive)
+    {
+      printf("\n");
+      fflush(stdout);
+    }
+    return 0;
+  }
+
+  // time whatever follows, built-in or not
+  if (strcmp(arg, TIME) == 0)
+  {
+    return timeCommand(cmd);
+  }
+
+  // place whatever follows on the given CPUs and NUMA nodes
+  if (strcmp(arg, PIN) == 0)
+  {
+    return pinCommand(cmd);
+  }
+
+  // return 1 when an exit command is read - caller function handles this case
+  if (strcmp(arg, EXIT_SHELL) == 0 && cmd->stageCount == 1)
+  {
+    return 1;
+  }
+
+  // a job spec on its own continues the job, in the background if followed by &
+  if (arg[0] == '%' && cmd->stageCount == 1 && cmd->stages[0].argc == 1)
+  {
+    char *spec[] = {arg, arg, NULL};
+    cmd->background ? backgroundJob(spec) : foregroundJob(spec);
+    return 0;
+  }
+
+  // built-ins only run in small shell when there is a single stage. Those which
+  // also exist as programs run as programs in pipelines, in the background and
+  // under pin
+  const Builtin *builtin = findBuiltin(arg);
+  if (builtin && cmd->stageCount == 1 && !(builtin->external && (cmd->background || placement)))
+  {
+    runBuiltin(cmd, builtin);
+    return 0;
+  }
+
+  // if no built-in commands are detected, pass the command struct along to the
+  // non built-in command handler
+  executeProgram(cmd);
+  return 0;
+}
+
+/**
+ * @brief Flushes standard output when interactive. Otherwise, output stays
+ *        buffered until a program is launched or smallsh exits.
+ */
+void flushOutput()
+{
+  if (interactive)
+  {
+    fflush(stdout);
+  }
+}
+
+/**
+ * @brief Hashes every built-in into the open addressing built-in index.
+ */
+void buildBuiltinIndex()
+{
+  unsigned mask = (1u << BUILTIN_INDEX_BITS) - 1;
+  for (int i = 0; i < BUILTIN_COUNT; i++)
+  {
+    unsigned slot = envHash(BUILTINS[i].name, strlen(BUILTINS[i].name)) & mask;
+    while (builtinIndex[slot])
+    {
+      slot = (slot + 1) & mask;
+    }
+    builtinIndex[slot] = i + 1;
+  }
+}
+
+/**
+ * @brief Looks up a built-in by name.
+ *
+ * @param name command name
+ * @return const Builtin* - the built-in, or NULL if the name isn't one
+ */
+const Builtin *findBuiltin(const char *name)
+{
+  unsigned mask = (1u << BUILTIN_INDEX_BITS) - 1;
+  for (unsigned slot = envHash(name, strlen(name)) & mask; builtinIndex[slot]; slot = (slot + 1) & mask)
+  {
+    const Builtin *builtin = &BUILTINS[builtinIndex[slot] - 1];
+    if (strcmp(builtin->name, name) == 0)
+    {
+      return builtin;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * @brief Runs a built-in within small shell, in the foreground even when the
+ *        command ends in &. Redirections are applied by moving each redirected
+ *        descriptor aside, applying the redirections for the duration of the
+ *        call and then moving them back.
+ *
+ * @param cmd command struct containing a single stage
+ * @param builtin built-in to run
+ */
+void runBuiltin(Command *cmd, const Builtin *builtin)
+{
+  // a built-in runs in the foreground despite a trailing &, so it keeps small
+  // shell's stdin and stdout instead of being given /dev/null
+  bool background = cmd->background;
+  cmd->background = false;
+  FdAction *actions;
+  int count = openRedirects(cmd, 0, -1, -1, &actions);
+  cmd->background = background;
+  if (count == -1)
+  {
+    lastProcessStatus = 1;
+    return;
+  }
+
+  // output so far belongs to the old descriptors. Each redirected descriptor
+  // is saved before its first change, or marked -1 if it wasn't open
+  fflush(stdout);
+  int saved[REDIRECT_FD_BASE];
+  bool changed[REDIRECT_FD_BASE] = {false};
+  for (int i = 0; i < count; i++)
+  {
+    int fd = actions[i].fd;
+    if (!changed[fd])
+    {
+      saved[fd] = fcntl(fd, F_DUPFD_CLOEXEC, REDIRECT_FD_BASE);
+      changed[fd] = true;
+    }
+    if (actions[i].source == -1)
+    {
+      close(fd);
+    }
+    else
+    {
+      dup2(actions[i].source, fd);
+    }
+  }
+  closeRedirects(actions, count);
+
+  builtin->run(cmd->stages[0].argv);
+
+  fflush(stdout);
+  for (int fd = 0; fd < REDIRECT_FD_BASE; fd++)
+  {
+    if (changed[fd] && saved[fd] != -1)
+    {
+      dup2(saved[fd], fd);
+      close(saved[fd]);
+    }
+    else if (changed[fd])
+    {
+      close(fd);
+    }
+  }
+  flushOutput();
+}
+
+//=============================================================================
+// Built-in commands
+//=============================================================================
+
+/**
+ * @brief Exits small shell by using the SIGKILL signal on any running background
+ *        processess before exiting the parent shell.
+ *
+ *        Reference: stackoverflow.com/questions/6501522/how-to-kill-a-child-process-by-the-parent-process
+ */
+void exitSmallsh()
+{
+  // jobs within the session cgroup are killed together by stopCgroupSession
+  for (int i = jobTable.liveList; i != -1; i = jobTable.jobs[i].next)
+  {
+    if (jobTable.jobs[i].cgroupFd == -1)
+    {
+      killJob(&jobTable.jobs[i]);
+    }
+  }
+  stopCgroupSession();
+  stopTrace();
+  exit(0);
+}
+
+/**
+ * @brief Change directory built-in command. Accepts a directory path and attempts
+ *        to change directory to that path, if it exists. Otherwise, the function
+ *        swaps to the directory specified inside the HOME environment variable.
+ * @param path directory to change to
+ * @return int - result from attempting to change directory
+ */
+int cd(char *path)
+{
+  if (path == NULL)
+  {
+    path = getenv("HOME");
+  }
+
+  int result = chdir(path);
+  if (result < 0)
+  {
+    perror("Error changing directory");
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * @brief Cd built-in, changing to the given directory or HOME.
+ *
+ * @param argv arguments of the built-in
+ */
+void changeDirectory(char **argv)
+{
+  lastProcessStatus = cd(argv[1]) == -1;
+}
+
+/**
+ * @brief Echo built-in which prints its arguments separated by spaces, with a
+ *        trailing newline unless the first argument is -n.
+ *
+ * @param argv arguments of the built-in
+ */
+void echoArguments(char **argv)
+{
+  bool newline = !argv[1] || strcmp(argv[1], "-n") != 0;
+  for (int i = newline ? 1 : 2; argv[i]; i++)
+  {
+    fputs(argv[i], stdout);
+    if (argv[i + 1])
+    {
+      putchar(' ');
+    }
+  }
+  if (newline)
+  {
+    putchar('\n');
+  }
+  lastProcessStatus = 0;
+}
+
+/**
+ * @brief True built-in, which only succeeds.
+ *
+ * @param argv arguments of the built-in (unused)
+ */
+void succeed(char **argv)
+{
+  (void)argv;
+  lastProcessStatus = 0;
+}
+
+/**
+ * @brief False built-in, which only fails.
+ *
+ * @param argv arguments of the built-in (unused)
+ */
+void fail(char **argv)
+{
+  (void)argv;
+  lastProcessStatus = 1;
+}
+
+/**
+ * @brief Test built-in, also run as [ expression ]. Evaluates a test
+ *        expression, setting the status to 0 if it is true, 1 if it is false
+ *        or 2 if it is malformed.
+ *
+ * @param argv arguments of the built-in
+ */
+void testExpression(char **argv)
+{
+  int count = 0;
+  while (argv[count + 1])
+  {
+    count++;
+  }
+  if (strcmp(argv[0], "[") == 0)
+  {
+    if (count == 0 || strcmp(argv[count], "]") != 0)
+    {
+      fprintf(stderr, "[: missing ]\n");
+      lastProcessStatus = 2;
+      return;
+    }
+    count--;
+  }
+  lastProcessStatus = evaluateTest(&argv[1], count);
+}
+
+/**
+ * @brief Evaluates a test expression of up to three arguments - a string, a
+ *        unary file or string test, a binary string or integer comparison, or
+ *        any of those negated by !.
+ *
+ * @param args arguments of the expression
+ * @param count number of arguments
+ * @return int - 0 if true, 1 if false, 2 if malformed
+ */
+int evaluateTest(char **args, int count)
+{
+  if (count == 0)
+  {
+    return 1;
+  }
+  if (strcmp(args[0], "!") == 0 && count > 1)
+  {
+    int result = evaluateTest(&args[1], count - 1);
+    return result == 2 ? 2 : !result;
+  }
+  if (count == 1)
+  {
+    return args[0][0] == '\0';
+  }
+
+  if (count == 2 && args[0][0] == '-' && args[0][1] && !args[0][2])
+  {
+    struct stat info;
+    char op = args[0][1];
+    bool exists = op == 'L' || op == 'h' ? lstat(args[1], &info) == 0 : stat(args[1], &info) == 0;
+    switch (op)
+    {
+    case 'n':
+      return args[1][0] == '\0';
+    case 'z':
+      return args[1][0] != '\0';
+    case 'e':
+      return !exists;
+    case 'f':
+      return !(exists && S_ISREG(info.st_mode));
+    case 'd':
+      return !(exists && S_ISDIR(info.st_mode));
+    case 'L':
+    case 'h':
+      return !(exists && S_ISLNK(info.st_mode));
+    case 's':
+      return !(exists && info.st_size > 0);
+    case 'r':
+      return access(args[1], R_OK) != 0;
+    case 'w':
+      return access(args[1], W_OK) != 0;
+    case 'x':
+      return access(args[1], X_OK) != 0;
+    }
+  }
+
+  if (count == 3)
+  {
+    const char *op = args[1];
+    if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0)
+    {
+      return strcmp(args[0], args[2]) != 0;
+    }
+    if (strcmp(op, "!=") == 0)
+    {
+      return strcmp(args[0], args[2]) == 0;
+    }
+
+    // integer comparisons, -eq -ne -lt -le -gt -ge
+    const char *ops[] = {"-eq", "-ne", "-lt", "-le", "-gt", "-ge"};
+    for (int i = 0; i < 6; i++)
+    {
+      if (strcmp(op, ops[i]) != 0)
+      {
+        continue;
+      }
+      char *end;
+      long long left = strtoll(args[0], &end, 10);
+      bool valid = *args[0] && !*end;
+      long long right = strtoll(args[2], &end, 10);
+      if (!valid || !*args[2] || *end)
+      {
+        fprintf(stderr, "test: integer expression expected\n");
+        return 2;
+      }
+      bool results[] = {left == right, left != right, left < right, left <= right, left > right, left >= right};
+      return !results[i];
+    }
+  }
+
+  fprintf(stderr, "test: %s: unexpected expression\n", args[count > 1]);
+  return 2;
+}
+
+/**
+ * @brief Pwd built-in which prints the current working directory.
+ *
+ * @param argv arguments of the built-in (unused)
+ */
+void printDirectory(char **argv)
+{
+  (void)argv;
+  char *cwd = getcwd(NULL, 0);
+  if (!cwd)
+  {
+    perror("pwd");
+    lastProcessStatus = 1;
+    return;
+  }
+  puts(cwd);
+  free(cwd);
+  lastProcessStatus = 0;
+}
+
+/**
+ * @brief Cat built-in, run as cat [-u] [file...]. Copies each file, or stdin
+ *        for - or no files, to stdout inside the kernel, so that copying a
+ *        large file through a redirection costs no fork and no copies
+ *        through user space. Any other option runs the cat program instead.
+ *        SIGINT abandons the copy.
+ *
+ * @param argv arguments of the built-in
+ */
+void catFiles(char **argv)
+{
+  // output is never buffered, so -u changes nothing
+  int i = 1 + (argv[1] && strcmp(argv[1], "-u") == 0);
+  for (int j = i; argv[j]; j++)
+  {
+    if (argv[j][0] == '-' && argv[j][1])
+    {
+      Command cmd = {NULL, 0, false, LIST_END};
+      int capacity = 0;
+      Stage *stage = addStage(&cmd, &capacity);
+      for (int k = 0; argv[k]; k++)
+      {
+        addArgument(stage, argv[k]);
+      }
+      executeProgram(&cmd);
+      return;
+    }
+  }
+
+  // a closed stdout, as with >&-, can't be copied to
+  struct stat output;
+  if (fstat(STDOUT_FILENO, &output) == -1)
+  {
+    fprintf(stderr, "cat: standard output: %s\n", strerror(errno));
+    lastProcessStatus = 1;
+    return;
+  }
+
+  // let SIGINT interrupt a blocking copy
+  struct sigaction previous;
+  beginInterruptibleWait(&previous);
+
+  lastProcessStatus = 0;
+  do
+  {
+    const char *name = argv[i] ? argv[i] : "-";
+    int fd = strcmp(name, "-") == 0 ? STDIN_FILENO : open(name, O_RDONLY | O_CLOEXEC);
+    struct stat input;
+    if (fd == -1 || fstat(fd, &input) == -1)
+    {
+      fprintf(stderr, "cat: %s: %s\n", name, strerror(errno));
+      lastProcessStatus = 1;
+      if (fd != -1 && fd != STDIN_FILENO)
+      {
+        close(fd);
+      }
+      continue;
+    }
+    if (fd != STDIN_FILENO)
+    {
+      posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+    if (S_ISREG(input.st_mode) && input.st_dev == output.st_dev && input.st_ino == output.st_ino &&
+        input.st_size > 0)
+    {
+      fprintf(stderr, "cat: %s: input file is output file\n", name);
+      lastProcessStatus = 1;
+    }
+    else if (!copyDescriptor(fd, input.st_mode, STDOUT_FILENO, output.st_mode) && !waitInterrupted)
+    {
+      fprintf(stderr, "cat: %s: %s\n", name, strerror(errno));
+      lastProcessStatus = 1;
+    }
+    if (fd != STDIN_FILENO)
+    {
+      close(fd);
+    }
+  } while (argv[i] && argv[++i] && !waitInterrupted);
+  endInterruptibleWait(&previous);
+
+  if (waitInterrupted)
+  {
+    lastProcessStatus = 128 + SIGINT;
+  }
+}
+
+/**
+ * @brief Copies everything left to read from one descriptor to another with
+ *        the cheapest call the pair supports - copy_file_range between
+ *        regular files, which may share extents instead of copying, sendfile
+ *        from a regular file, and splice to or from a pipe - falling back to
+ *        the next whenever the kernel or file system refuses, and finally to
+ *        read and write. An O_APPEND output, which copy_file_range and
+ *        sendfile refuse, is positioned at its end and has O_APPEND cleared
+ *        for the duration of the copy.
+ *
+ * @param in descriptor to copy from
+ * @param inMode file type and mode of in, from fstat
+ * @param out descriptor to copy to
+ * @param outMode file type and mode of out, from fstat
+ * @return bool - false on failure or SIGINT, with errno set
+ */
+bool copyDescriptor(int in, mode_t inMode, int out, mode_t outMode)
+{
+  int flags = fcntl(out, F_GETFL);
+  bool append = S_ISREG(outMode) && flags != -1 && (flags & O_APPEND) && lseek(out, 0, SEEK_END) != -1 &&
+                fcntl(out, F_SETFL, flags & ~O_APPEND) != -1;
+
+  CopyMethod method = nextCopyMethod(COPY_RANGE, inMode, outMode);
+  char *buffer = NULL;
+  ssize_t count = -1;
+  while (!waitInterrupted)
+  {
+    switch (method)
+    {
+    case COPY_RANGE:
+      count = copy_file_range(in, NULL, out, NULL, COPY_CHUNK_SIZE, 0);
+      break;
+    case COPY_SENDFILE:
+      count = sendfile(out, in, NULL, COPY_CHUNK_SIZE);
+      break;
+    case COPY_SPLICE:
+      count = splice(in, NULL, out, NULL, COPY_CHUNK_SIZE, SPLICE_F_MOVE | SPLICE_F_MORE);
+      break;
+    default:
+      buffer = buffer ? buffer : allocate(&commandArena, STREAM_BUFFER_SIZE);
+      count = read(in, buffer, STREAM_BUFFER_SIZE);
+      for (ssize_t written = 0, result; count > 0 && written < count; written += result)
+      {
+        result = write(out, buffer + written, count - written);
+        if (result == -1 && errno != EINTR)
+        {
+          count = -1;
+        }
+        result = result == -1 ? 0 : result;
+      }
+    }
+
+    if (count == 0 || (count == -1 && errno != EINTR && (method == COPY_READ ||
+                      (errno != EINVAL && errno != EXDEV && errno != ENOSYS && errno != EOPNOTSUPP && errno != EBADF))))
+    {
+      break;
+    }
+    if (count == -1 && errno != EINTR)
+    {
+      method = nextCopyMethod(method + 1, inMode, outMode);
+    }
+  }
+
+  int error = errno;
+  if (append)
+  {
+    fcntl(out, F_SETFL, flags);
+  }
+  errno = waitInterrupted ? EINTR : error;
+  return count == 0 && !waitInterrupted;
+}
+
+/**
+ * @brief Finds the first way of copying, starting from the given one, which
+ *        suits the file types of both ends.
+ *
+ * @param method first method to consider
+ * @param inMode file type and mode of the input
+ * @param outMode file type and mode of the output
+ * @return CopyMethod - method to try next
+ */
+CopyMethod nextCopyMethod(CopyMethod method, mode_t inMode, mode_t outMode)
+{
+  if (method == COPY_RANGE && !(S_ISREG(inMode) && S_ISREG(outMode)))
+  {
+    method = COPY_SENDFILE;
+  }
+  if (method == COPY_SENDFILE && !S_ISREG(inMode))
+  {
+    method = COPY_SPLICE;
+  }
+  if (method == COPY_SPLICE && !S_ISFIFO(inMode) && !S_ISFIFO(outMode))
+  {
+    method = COPY_READ;
+  }
+  return method;
+}
+
+/**
+ * @brief Printf built-in, run as printf format [arguments...] The format
+ *        supports the \ escapes of C and the conversions %s, %c, %d, %i, %u,
+ *        %o, %x and %X with flags, width and precision. The format is reused
+ *        while arguments remain, and missing arguments are empty or zero.
+ *
+ * @param argv arguments of the built-in
+ */
+void printFormatted(char **argv)
+{
+  if (!argv[1])
+  {
+    fprintf(stderr, "usage: printf format [arguments...]\n");
+    lastProcessStatus = 1;
+    return;
+  }
+  lastProcessStatus = 0;
+
+  char **args = &argv[2];
+  bool consumed;
+  do
+  {
+    consumed = false;
+    for (const char *p = argv[1]; *p; p++)
+    {
+      if (*p == '\\')
+      {
+        p = printEscape(p);
+        continue;
+      }
+      if (*p != '%' || p[1] == '%')
+      {
+        putchar(*p);
+        p += *p == '%';
+        continue;
+      }
+
+      // copy the flags, width and precision of the conversion into a format
+      char spec[32] = "%";
+      size_t length = 1 + strspn(p + 1, "-+ #0");
+      length += strspn(p + length, "0123456789.");
+      if (length > sizeof(spec) - 4)
+      {
+        length = sizeof(spec) - 4;
+      }
+      memcpy(spec, p, length);
+      p += length;
+
+      const char *arg = *args ? *args++ : NULL;
+      consumed = consumed || arg;
+      switch (*p)
+      {
+      case 's':
+        strcpy(spec + length, "s");
+        printf(spec, arg ? arg : "");
+        break;
+      case 'c':
+        strcpy(spec + length, "c");
+        printf(spec, arg && *arg ? *arg : ' ');
+        break;
+      case 'd':
+      case 'i':
+        strcpy(spec + length, "lld");
+        printf(spec, arg ? strtoll(arg, NULL, 0) : 0ll);
+        break;
+      case 'u':
+      case 'o':
+      case 'x':
+      case 'X':
+        spec[length] = 'l';
+        spec[length + 1] = 'l';
+        spec[length + 2] = *p;
+        spec[length + 3] = '\0';
+        printf(spec, arg ? strtoull(arg, NULL, 0) : 0ull);
+        break;
+      default:
+        fprintf(stderr, "printf: %%%c: invalid conversion\n", *p ? *p : ' ');
+        lastProcessStatus = 1;
+        return;
+      }
+    }
+  } while (consumed && *args);
+}
+
+/**
+ * @brief Prints the character for a \ escape of a printf format.
+ *
+ * @param p position of the backslash
+ * @return const char* - position of the last character of the escape
+ */
+const char *printEscape(const char *p)
+{
+  const char *from = "abfnrtv\\\"";
+  const char *to = "\a\b\f\n\r\t\v\\\"";
+  const char *escape = p[1] ? strchr(from, p[1]) : NULL;
+  if (escape)
+  {
+    putchar(to[escape - from]);
+    return p + 1;
+  }
+  putchar('\\');
+  return p;
+}
+
+/**
+ * @brief Export built-in which sets each NAME=value argument in the
+ *        environment, marking the environment snapshot stale.
+ *
+ * @param argv arguments of the built-in
+ */
+void exportVariables(char **argv)
+{
+  lastProcessStatus = 0;
+  for (int i = 1; argv[i]; i++)
+  {
+    char *equals = strchr(argv[i], '=');
+    if (!equals || equals == argv[i])
+    {
+      continue;
+    }
+
+    *equals = '\0';
+    if (setenv(argv[i], equals + 1, 1) == -1)
+    {
+      perror("Error exporting variable");
+      lastProcessStatus = 1;
+    }
+    if (strcmp(argv[i], "PATH") == 0)
+    {
+      clearPathCache();
+    }
+    *equals = '=';
+    envIndex.stale = true;
+  }
+}
+
+/**
+ * @brief Unset built-in which removes each named variable from the
+ *        environment, marking the environment snapshot stale.
+ *
+ * @param argv arguments of the built-in
+ */
+void unsetVariables(char **argv)
+{
+  lastProcessStatus = 0;
+  for (int i = 1; argv[i]; i++)
+  {
+    if (unsetenv(argv[i]) == -1)
+    {
+      perror("Error unsetting variable");
+      lastProcessStatus = 1;
+    }
+    if (strcmp(argv[i], "PATH") == 0)
+    {
+      clearPathCache();
+    }
+    envIndex.stale = true;
+  }
+}
+
+/**
+ * @brief Hash built-in for the PATH cache. With no arguments, prints each
+ *        cached command along with how many times it has been used. -r clears
+ *        the cache, and any command names are looked up and added to it.
+ *
+ * @param argv arguments of the built-in
+ */
+void hashCommands(char **argv)
+{
+  lastProcessStatus = 0;
+
+  if (!argv[1])
+  {
+    if (pathCache.count == 0)
+    {
+      printf("hash: hash table empty\n");
+    }
+    else
+    {
+      printf("hits\tcommand\n");
+      for (int i = 0; i < (1 << pathCache.bits); i++)
+      {
+        PathEntry *entry = &pathCache.entries[i];
+        if (entry->name)
+        {
+          printf("%4d\t%s\n", entry->hits, entry->path);
+        }
+      }
+    }
+    flushOutput();
+    return;
+  }
+
+  for (int i = 1; argv[i]; i++)
+  {
+    if (strcmp(argv[i], "-r") == 0)
+    {
+      clearPathCache();
+      continue;
+    }
+
+    // prefilled entries start with no hits
+    bool cached;
+    if (strchr(argv[i], '/') || !resolveCommand(argv[i], &cached))
+    {
+      fprintf(stderr, "hash: %s: not found\n", argv[i]);
+      lastProcessStatus = 1;
+      continue;
+    }
+    findCommand(argv[i])->hits -= !cached;
+  }
+}
+
+/**
+ * @brief Jobs built-in - lists each background job, oldest first, with its
+ *        job id, process group, state (running or stopped), elapsed time and
+ *        command.
+ *
+ * @param argv arguments of the built-in (unused)
+ */
+void listJobs(char **argv)
+{
+  (void)argv;
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  // walk the live list back from its tail, where the oldest job is
+  for (Job *job = oldestJob(false); job; job = job->prev != -1 ? &jobTable.jobs[job->prev] : NULL)
+  {
+    long elapsed = now.tv_sec - job->started.tv_sec - (now.tv_nsec < job->started.tv_nsec);
+    printf("[%d] %d %s %ld:%02ld %s\n", job->id, job->pgid, job->stopped ? "Stopped" : "Running", elapsed / 60,
+           elapsed % 60, job->command);
+  }
+  fflush(stdout);
+  lastProcessStatus = 0;
+}
+
+/**
+ * @brief Wait built-in, run as wait [pid|%job]... Blocks in waitpid until each
+ *        given background job has finished or stopped, or every running job if
+ *        none are given, setting the status to that of the last job waited for.
+ *        A job which is already stopped isn't waited for, giving 128 plus
+ *        SIGTSTP. SIGINT abandons the wait, leaving the jobs running.
+ *
+ * @param argv arguments of the built-in
+ */
+void waitJobs(char **argv)
+{
+  // let SIGINT interrupt the blocking waitpid
+  struct sigaction previous;
+  beginInterruptibleWait(&previous);
+
+  int result = 0;
+  if (!argv[1])
+  {
+    // stopped jobs would never finish, so only running jobs are waited for
+    for (Job *job; result != -1 && (job = oldestJob(true));)
+    {
+      result = waitJob(job, false);
+
+      // a job which couldn't be waited for is still the oldest, so give up
+      if (oldestJob(true) == job)
+      {
+        break;
+      }
+    }
+  }
+  for (int i = 1; argv[i] && result != -1; i++)
+  {
+    Job *job = lookupJob(argv[i]);
+    if (!job)
+    {
+      fprintf(stderr, "wait: %s: no such job\n", argv[i]);
+      result = 127;
+      continue;
+    }
+
+    // a stopped job won't finish until it is continued
+    result = job->stopped ? 128 + SIGTSTP : waitJob(job, false);
+  }
+  endInterruptibleWait(&previous);
+  drainNotifications();
+
+  if (result == -1)
+  {
+    printf("\n");
+    fflush(stdout);
+    result = 1;
+  }
+  lastProcessStatus = result;
+}
+
+/**
+ * @brief Fg built-in, run as fg [pid|%job]. Hands the terminal to a stopped or
+ *        background job, newest first without an argument, with the terminal
+ *        settings it stopped with, continues it and waits for it like a
+ *        foreground pipeline until it finishes or is stopped again.
+ *
+ * @param argv arguments of the built-in
+ */
+void foregroundJob(char **argv)
+{
+  Job *job = argv[1] ? lookupJob(argv[1]) : currentJob(false);
+  if (!terminal || !job)
+  {
+    fprintf(stderr, terminal ? "fg: %s: no such job\n" : "fg: no job control\n", argv[1] ? argv[1] : "current");
+    lastProcessStatus = 1;
+    return;
+  }
+  printf("%s\n", job->command);
+  fflush(stdout);
+
+  if (job->modesSaved)
+  {
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &job->modes);
+  }
+  tcsetpgrp(STDIN_FILENO, job->pgid);
+  job->stopped = false;
+  job->foreground = true;
+  kill(-job->pgid, SIGCONT);
+
+  // a job which stops again has already taken back the terminal
+  int result = waitJob(job, true);
+  tcsetpgrp(STDIN_FILENO, getpgrp());
+  lastProcessStatus = result == -1 ? 1 : result;
+}
+
+/**
+ * @brief Bg built-in, run as bg [pid|%job]... Continues each given stopped job
+ *        in the background, or the newest stopped job without an argument.
+ *
+ * @param argv arguments of the built-in
+ */
+void backgroundJob(char **argv)
+{
+  lastProcessStatus = 0;
+  int i = 1;
+  do
+  {
+    Job *job = argv[i] ? lookupJob(argv[i]) : currentJob(true);
+    if (!job)
+    {
+      fprintf(stderr, "bg: %s: no such job\n", argv[i] ? argv[i] : "current");
+      lastProcessStatus = 1;
+      continue;
+    }
+    job->stopped = false;
+    kill(-job->pgid, SIGCONT);
+    printf("[%d] %d Running %s &\n", job->id, job->pgid, job->command);
+    flushOutput();
+  } while (argv[i] && argv[++i]);
+}
+
+/**
+ * @brief Fgonly built-in, entering or leaving foreground only mode, in which
+ *        & is ignored and every command runs in the foreground.
+ *
+ * @param argv arguments of the built-in (unused)
+ */
+void toggleForegroundOnly(char **argv)
+{
+  (void)argv;
+  foregroundOnly = !foregroundOnly;
+  announceForegroundMode();
+  lastProcessStatus = 0;
+}
+
+/**
+ * @brief SIGINT handler while the wait built-in is blocked, flagging that the
+ *        wait should be abandoned.
+ *
+ * @param signo signal number
+ */
+void interruptWait(int signo)
+{
+  (void)signo;
+  waitInterrupted = 1;
+}
+
+/**
+ * @brief Catches SIGINT without SA_RESTART while a built-in blocks, so that it
+ *        interrupts the blocking call and sets waitInterrupted.
+ *
+ * @param previous set to the SIGINT action to restore afterwards
+ */
+void beginInterruptibleWait(struct sigaction *previous)
+{
+  struct sigaction SIGINT_action = {0};
+  SIGINT_action.sa_handler = interruptWait;
+  sigfillset(&SIGINT_action.sa_mask);
+  sigaction(SIGINT, &SIGINT_action, previous);
+  waitInterrupted = 0;
+}
+
+/**
+ * @brief Restores the SIGINT action replaced by beginInterruptibleWait.
+ *
+ * @param previous SIGINT action to restore
+ */
+void endInterruptibleWait(const struct sigaction *previous)
+{
+  sigaction(SIGINT, previous, NULL);
+}
+
+/**
+ * @brief Status built-in which prints the status of the last process run by
+ *        smallsh, either its exit value or the signal which terminated it.
+ *        With -v, the resources used by the last foreground pipeline are
+ *        printed as well.
+ *
+ * @param argv arguments of the built-in
+ */
+void status(char **argv)
+{
+  if (lastSignal && lastProcessStatus == 128 + lastSignal)
+  {
+    printf("terminated by signal %d\n", lastSignal);
+  }
+  else
+  {
+    printf("exit value %d\n", lastProcessStatus);
+  }
+  if (argv[1] && strcmp(argv[1], "-v") == 0)
+  {
+    printUsage(stdout, &lastUsage);
+  }
+  flushOutput();
+}
+
+/**
+ * @brief Set built-in, run as set -o option to turn a shell option on or
+ *        set +o option to turn it off. The trace option writes to the file
+ *        named by SMALLSH_TRACE, or smallsh.trace, and the notify option, also
+ *        set with -b and +b, reports background jobs as soon as they finish,
+ *        even while a foreground command is running. The cgroups option
+ *        launches every background job into a cgroup of its own, within a
+ *        session cgroup which is killed as a whole when small shell exits.
+ *
+ * @param argv arguments of the built-in
+ */
+void setOptions(char **argv)
+{
+  lastProcessStatus = 0;
+  for (int i = 1; argv[i]; i += 2)
+  {
+    bool on = argv[i][0] == '-';
+    if (strcmp(argv[i] + 1, "b") == 0 && (on || argv[i][0] == '+'))
+    {
+      notifyImmediately = on;
+      i--;
+      continue;
+    }
+    if ((!on && strcmp(argv[i], "+o") != 0) || (on && strcmp(argv[i], "-o") != 0) || !argv[i + 1] ||
+        (strcmp(argv[i + 1], TRACE_OPTION) != 0 && strcmp(argv[i + 1], NOTIFY_OPTION) != 0 &&
+         strcmp(argv[i + 1], CGROUP_OPTION) != 0))
+    {
+      fprintf(stderr, "usage: set [-+]b | set [-+]o trace|notify|cgroups\n");
+      lastProcessStatus = 1;
+      return;
+    }
+    if (strcmp(argv[i + 1], NOTIFY_OPTION) == 0)
+    {
+      notifyImmediately = on;
+    }
+    else if (strcmp(argv[i + 1], CGROUP_OPTION) == 0)
+    {
+      if (on && cgroupSession.fd == -1 && !startCgroupSession())
+      {
+        lastProcessStatus = 1;
+        return;
+      }
+      cgroupSession.enabled = on;
+    }
+    else if (on && !tracing)
+    {
+      startTrace(getenv(TRACE_VARIABLE) ? getenv(TRACE_VARIABLE) : DEFAULT_TRACE_FILE);
+    }
+    else if (!on)
+    {
+      stopTrace();
+    }
+  }
+}
+
+/**
+ * @brief Time prefix, run as time command... Runs the rest of the line, then
+ *        prints the wall clock time and the CPU time and context switches of
+ *        small shell and the children it reaped in the meantime to stderr,
+ *        along with the largest max RSS of the command's own processes.
+ *
+ * @param cmd command line, whose first word is time
+ * @return int - 1 if the timed command was exit, otherwise 0
+ */
+int timeCommand(Command *cmd)
+{
+  struct timespec started;
+  struct rusage self, children;
+  clock_gettime(CLOCK_MONOTONIC, &started);
+  getrusage(RUSAGE_SELF, &self);
+  getrusage(RUSAGE_CHILDREN, &children);
+  lastUsage = (Usage){0};
+
+  cmd->stages[0].argv++;
+  cmd->stages[0].argc--;
+  int result = mapArguments(cmd);
+
+  // take the difference of small shell and its reaped children's usage
+  struct rusage selfAfter, childrenAfter;
+  getrusage(RUSAGE_SELF, &selfAfter);
+  getrusage(RUSAGE_CHILDREN, &childrenAfter);
+  Usage usage = {0};
+  addUsage(&usage, &selfAfter);
+  addUsage(&usage, &childrenAfter);
+  Usage before = {0};
+  addUsage(&before, &self);
+  addUsage(&before, &children);
+  usage.real = elapsedSince(&started);
+  usage.user -= before.user;
+  usage.system -= before.system;
+  usage.voluntarySwitches -= before.voluntarySwitches;
+  usage.involuntarySwitches -= before.involuntarySwitches;
+  // peak RSS doesn't subtract, so it is taken from the command's own children
+  // as each was reaped, and left out when the command reaped none
+  usage.maxRss = lastUsage.maxRss;
+
+  fflush(stdout);
+  printUsage(stderr, &usage);
+  return result;
+}
+
+//=============================================================================
+// Handling execution for all other commands
+//=============================================================================
+
+/**
+ * @brief Function which executes non built-in programs for Small Shell. Each
+ *        stage of the pipeline is launched into a child process running
+ *        concurrently with the others, connected to its neighbours by pipes.
+ *        Every stage joins the process group of the first, which is handed the
+ *        terminal when run in the foreground. Foreground pipelines are waited
+ *        on as a group, while background pipelines are added to the job table.
+ *
+ *        Stages are launched with posix_spawn, which avoids copying the page
+ *        tables of the shell, unless a stage needs something the spawn
+ *        attributes cannot express, in which case it is forked.
+ *
+ * @param cmd command struct containing parsed pipeline stages
+ * @return bool - whether any stage was launched. A pipeline which couldn't be
+ *         launched, whether a program failed to start or a pipe or fork ran
+ *         into a resource limit, sets the status to 1 instead
+ */
+bool executeProgram(Command *cmd)
+{
+  pid_t *pids = allocate(&commandArena, cmd->stageCount * sizeof(pid_t));
+  int count = 0;         // number of processes launched
+  bool lastFailed = false;
+  pid_t pgid = 0;
+  int inFd = -1; // read end of the pipe from the previous stage
+
+  // a background job joins its own cgroup as it is cloned, when enabled
+  int cgroupId = 0;
+  if (cmd->background && cgroupSession.enabled)
+  {
+    launchCgroup = createJobCgroup(&cgroupId);
+  }
+
+  // posix_spawn can only hand the terminal to a foreground pipeline on newer
+  // glibc, and has no attributes for a placement, resource limits or a cgroup
+  bool spawn = !forkOnly && !placement && !commandLimitMask && launchCgroup == -1 &&
+               (SPAWN_TCSETPGRP || cmd->background || !terminal);
+
+  // output buffered so far must precede the output of the children
+  fflush(stdout);
+  struct timespec started;
+  clock_gettime(CLOCK_MONOTONIC, &started);
+
+  // reference: heavily adapted from Module 4: Process API - Executing a New Program
+  for (int i = 0; i < cmd->stageCount; i++)
+  {
+    // every stage but the last writes into a pipe read by the next stage
+    int pipeFds[2] = {-1, -1};
+    if (i < cmd->stageCount - 1 && pipe2(pipeFds, O_CLOEXEC) == -1)
+    {
+      // a pipeline missing a stage can't run, so none of it is left running
+      perror("Error creating pipe");
+      if (inFd != -1)
+      {
+        close(inFd);
+      }
+      abandonStages(cmd, pgid, pids, count);
+      count = 0;
+      break;
+    }
+
+    struct timespec mark;
+    traceMark(&mark);
+    pid_t pid = spawn ? spawnStage(cmd, i, inFd, pipeFds[1], pgid)
+                      : forkStage(cmd, i, inFd, pipeFds[1], pgid);
+    traceStage(spawn ? TRACE_SPAWN : TRACE_FORK, &mark);
+
+    // place the child into the pipeline's process group as well, so that it
+    // is a member whichever of parent or child runs first
+    if (pid == -1)
+    {
+      lastFailed = i == cmd->stageCount - 1;
+    }
+    else
+    {
+      if (pgid == 0)
+      {
+        pgid = pid;
+        if (!cmd->background && terminal)
+        {
+          tcsetpgrp(STDIN_FILENO, pgid);
+        }
+      }
+      setpgid(pid, pgid);
+      pids[count++] = pid;
+    }
+
+    // close the pipe ends now owned by the children
+    if (inFd != -1)
+    {
+      close(inFd);
+    }
+    if (pipeFds[1] != -1)
+    {
+      close(pipeFds[1]);
+    }
+    inFd = pipeFds[0];
+  }
+
+  if (count == 0)
+  {
+    lastProcessStatus = 1;
+    if (launchCgroup != -1)
+    {
+      Job unlaunched = {.cgroupFd = launchCgroup, .cgroupId = cgroupId};
+      removeJobCgroup(&unlaunched);
+      launchCgroup = -1;
+    }
+  }
+  else if (cmd->background)
+  {
+    // print pid of background process and add it to the job table, tagged
+    // with the server client it came from, if any
+    if (launchClient == -1)
+    {
+      printf("background pid is %d\n", pgid);
+      flushOutput();
+    }
+
+    Job *job = addJob(pgid, pids, count, describeCommand(cmd));
+    job->cgroupFd = launchCgroup;
+    job->cgroupId = cgroupId;
+    job->client = launchClient;
+    job->line = launchLine;
+    launchCgroup = -1;
+    launchClient = -1;
+    lastBackgroundPid = pids[count - 1];
+  }
+  else
+  {
+    struct timespec mark;
+    traceMark(&mark);
+    waitForeground(cmd, pgid, pids, count, lastFailed ? -1 : pids[count - 1], &started);
+    traceStage(TRACE_WAIT, &mark);
+    if (lastFailed)
+    {
+      lastProcessStatus = 1;
+    }
+  }
+  return count > 0;
+}
+
+/**
+ * @brief Kills the stages of a pipeline which couldn't be completed, as their
+ *        process group, and reaps them before they join the job table. The
+ *        terminal is taken back from a foreground pipeline.
+ *
+ * @param cmd command struct containing parsed pipeline stages
+ * @param pgid process group of the pipeline, or 0 if no stage was launched
+ * @param pids pids of the stages launched
+ * @param count number of stages launched
+ */
+void abandonStages(Command *cmd, pid_t pgid, const pid_t *pids, int count)
+{
+  if (count == 0)
+  {
+    return;
+  }
+  kill(-pgid, SIGKILL);
+  for (int i = 0; i < count; i++)
+  {
+    while (waitpid(pids[i], NULL, 0) == -1 && errno == EINTR)
+    {
+    }
+  }
+  if (!cmd->background && terminal)
+  {
+    tcsetpgrp(STDIN_FILENO, getpgrp());
+  }
+}
+
+/**
+ * @brief Joins the arguments of every stage of a pipeline back into a single
+ *        line of text, allocated from the command arena.
+ *
+ * @param cmd parsed pipeline
+ * @return char* - text of the pipeline
+ */
+char *describeCommand(Command *cmd)
+{
+  Buffer text = {NULL, 0, 0};
+  for (int i = 0; i < cmd->stageCount; i++)
+  {
+    if (i > 0)
+    {
+      appendBuffer(&text, " | ", 3);
+    }
+    for (int j = 0; j < cmd->stages[i].argc; j++)
+    {
+      if (j > 0)
+      {
+        appendBuffer(&text, " ", 1);
+      }
+      appendBuffer(&text, cmd->stages[i].argv[j], strlen(cmd->stages[i].argv[j]));
+    }
+  }
+  appendBuffer(&text, "", 1);
+  return text.data;
+}
+
+/**
+ * @brief Launches a pipeline stage with posix_spawn. File actions connect the
+ *        neighbouring pipes and redirection files, which are opened by the
+ *        parent so errors can be reported by filename. Spawn attributes place
+ *        the child into the pipeline's process group and restore default
+ *        signal dispositions. Without job control, SIGTSTP is blocked in the
+ *        child as small shell uses it to toggle foreground only mode, and so
+ *        it is in a child staying in small shell's process group.
+ *
+ * @param cmd command struct containing parsed pipeline stages
+ * @param index index of the stage to launch
+ * @param inFd read end of the pipe from the previous stage, or -1
+ * @param outFd write end of the pipe to the next stage, or -1
+ * @param pgid process group of the pipeline, 0 to lead a new one, or -1 to
+ *             stay in small shell's process group
+ * @return pid_t - pid of the child, or -1 on failure
+ */
+pid_t spawnStage(Command *cmd, int index, int inFd, int outFd, pid_t pgid)
+{
+  extern char **environ;
+  Stage *stage = &cmd->stages[index];
+  pid_t pid = -1;
+
+  // open the files redirected to by the stage, or /dev/null
+  FdAction *fdActions;
+  int count = openRedirects(cmd, index, inFd, outFd, &fdActions);
+  if (count == -1)
+  {
+    return -1;
+  }
+
+  // take the terminal while stdin is still the terminal, then connect the
+  // pipes and apply the redirections in order - the parent's copies of every
+  // descriptor are close-on-exec
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+#if SPAWN_TCSETPGRP
+  if (!cmd->background && terminal && pgid != -1)
+  {
+    posix_spawn_file_actions_addtcsetpgrp_np(&actions, STDIN_FILENO);
+  }
+#endif
+  for (int i = 0; i < count; i++)
+  {
+    if (fdActions[i].source == -1)
+    {
+      posix_spawn_file_actions_addclose(&actions, fdActions[i].fd);
+    }
+    else
+    {
+      posix_spawn_file_actions_adddup2(&actions, fdActions[i].source, fdActions[i].fd);
+    }
+  }
+
+  // foreground children take the default action for SIGINT, and every child
+  // for SIGTTOU and SIGTSTP, which small shell ignores or handles. SIGTSTP
+  // stays blocked unless there is job control to continue a stopped child,
+  // which a child staying in small shell's process group is out of reach of
+  sigset_t defaults;
+  sigset_t mask;
+  sigemptyset(&defaults);
+  sigaddset(&defaults, SIGTTOU);
+  sigaddset(&defaults, SIGTSTP);
+  if (!cmd->background)
+  {
+    sigaddset(&defaults, SIGINT);
+  }
+  sigemptyset(&mask);
+  if (!terminal || pgid == -1)
+  {
+    sigaddset(&mask, SIGTSTP);
+  }
+
+  posix_spawnattr_t attr;
+  posix_spawnattr_init(&attr);
+  posix_spawnattr_setflags(&attr, (pgid != -1 ? POSIX_SPAWN_SETPGROUP : 0) | POSIX_SPAWN_SETSIGDEF |
+                                      POSIX_SPAWN_SETSIGMASK);
+  posix_spawnattr_setpgroup(&attr, pgid != -1 ? pgid : 0);
+  posix_spawnattr_setsigdefault(&attr, &defaults);
+  posix_spawnattr_setsigmask(&attr, &mask);
+
+  // a cached path which no longer exists is forgotten and looked up again
+  bool cached;
+  const char *path = resolveCommand(stage->argv[0], &cached);
+  int error = path ? posix_spawn(&pid, path, &actions, &attr, stage->argv, environ) : ENOENT;
+  if (error == ENOENT && cached)
+  {
+    forgetCommand(stage->argv[0]);
+    path = resolveCommand(stage->argv[0], &cached);
+    error = path ? posix_spawn(&pid, path, &actions, &attr, stage->argv, environ) : ENOENT;
+  }
+  posix_spawnattr_destroy(&attr);
+  posix_spawn_file_actions_destroy(&actions);
+  closeRedirects(fdActions, count);
+
+  if (error)
+  {
+    fprintf(stderr, "Error executing command: %s\n", strerror(error));
+    return -1;
+  }
+  return pid;
+}
+
+/**
+ * @brief Launches a pipeline stage by forking small shell, for stages which
+ *        posix_spawn cannot launch. Exits small shell on fork failure.
+ *
+ * @param cmd command struct containing parsed pipeline stages
+ * @param index index of the stage to launch
+ * @param inFd read end of the pipe from the previous stage, or -1
+ * @param outFd write end of the pipe to the next stage, or -1
+ * @param pgid process group of the pipeline, 0 to lead a new one, or -1 to
+ *             stay in small shell's process group
+ * @return pid_t - pid of the child, or -1 if a redirection failed or the fork did
+ */
+pid_t forkStage(Command *cmd, int index, int inFd, int outFd, pid_t pgid)
+{
+  // open redirections and resolve the program in the parent, where errors are
+  // reported and the PATH cache lives
+  FdAction *actions;
+  int count = openRedirects(cmd, index, inFd, outFd, &actions);
+  if (count == -1)
+  {
+    return -1;
+  }
+  bool cached;
+  const char *path = resolveCommand(cmd->stages[index].argv[0], &cached);
+
+  // the child must not write out trace records buffered by the parent
+  if (tracing)
+  {
+    fflush(traceFile);
+  }
+  pid_t pid = launchCgroup != -1 ? forkIntoCgroup(launchCgroup) : fork();
+
+  // a fork failure, such as EAGAIN at the process limit, fails only this stage
+  if (pid == -1)
+  {
+    perror("Error forking");
+  }
+
+  // child
+  else if (pid == 0)
+  {
+    runStage(cmd, index, pgid, path, actions, count);
+  }
+  closeRedirects(actions, count);
+  return pid;
+}
+
+/**
+ * @brief Runs within a forked child to execute a single pipeline stage. The
+ *        child joins the pipeline's process group and applies any placement
+ *        given by pin and the limits set by ulimit, then connects the neighbouring pipes and applies its
+ *        redirections in a single sweep over the descriptor operations
+ *        prepared by the parent, before executing the program. Never returns.
+ *
+ * @param cmd command struct containing parsed pipeline stages
+ * @param index index of the stage to run
+ * @param pgid process group of the pipeline, 0 to lead a new one, or -1 to
+ *             stay in small shell's process group
+ * @param path resolved path of the program, or NULL to search PATH
+ * @param actions descriptor operations to apply, in order
+ * @param count number of descriptor operations
+ */
+void runStage(Command *cmd, int index, pid_t pgid, const char *path, FdAction *actions, int count)
+{
+  Stage *stage = &cmd->stages[index];
+
+  // join the pipeline's process group, taking the terminal if in the foreground
+  if (pgid != -1)
+  {
+    setpgid(0, pgid);
+    if (!cmd->background && terminal)
+    {
+      tcsetpgrp(STDIN_FILENO, pgid ? pgid : getpid());
+    }
+  }
+
+  resetChildSignals(cmd->background, pgid == -1);
+  if (placement)
+  {
+    applyPlacement(placement);
+  }
+  applyLimits();
+
+  for (int i = 0; i < count; i++)
+  {
+    if (actions[i].source == -1)
+    {
+      close(actions[i].fd);
+    }
+    else if (dup2(actions[i].source, actions[i].fd) == -1)
+    {
+      perror("Error redirecting");
+      _exit(1);
+    }
+  }
+
+  // execute program - the pipe descriptors are close-on-exec. If the resolved
+  // path has gone away, fall back to searching PATH
+  if (path)
+  {
+    execv(path, stage->argv);
+  }
+  execvp(stage->argv[0], stage->argv);
+  perror("Error executing command");
+  _exit(1);
+}
+
+/**
+ * @brief Gives a forked child the same signal dispositions as a spawned one,
+ *        in a single step: foreground children take the default action for
+ *        SIGINT, every child for SIGTTOU, SIGCHLD and SIGTSTP, and without job
+ *        control SIGTSTP is blocked as small shell uses it to toggle
+ *        foreground only mode. It is blocked as well in a child staying in
+ *        small shell's process group, which the terminal's Ctrl-Z reaches
+ *        but no job control would continue.
+ *
+ * @param background whether the child belongs to a background pipeline
+ * @param shellGroup whether the child stays in small shell's process group
+ */
+void resetChildSignals(bool background, bool shellGroup)
+{
+  static const int defaults[] = {SIGINT, SIGTTOU, SIGCHLD, SIGTSTP};
+
+  struct sigaction action = {0};
+  action.sa_handler = SIG_DFL;
+  for (size_t i = background; i < sizeof(defaults) / sizeof(defaults[0]); i++)
+  {
+    sigaction(defaults[i], &action, NULL);
+  }
+
+  sigset_t mask;
+  sigemptyset(&mask);
+  if (!terminal || shellGroup)
+  {
+    sigaddset(&mask, SIGTSTP);
+  }
+  sigprocmask(SIG_SETMASK, &mask, NULL);
+}
+
+/**
+ * @brief Prepares the descriptor operations which set up a pipeline stage,
+ *        opening any files and here-strings it redirects from or to. The
+ *        neighbouring pipes are connected first. Background pipelines then
+ *        read from and write to /dev/null, before the redirections are applied
+ *        in the order written. Opened descriptors are close-on-exec and moved
+ *        above the single digit descriptors a redirection can name, so no
+ *        operation can overwrite one before it is used.
+ *
+ * @param cmd command struct containing parsed pipeline stages
+ * @param index index of the stage
+ * @param inFd read end of the pipe from the previous stage, or -1
+ * @param outFd write end of the pipe to the next stage, or -1
+ * @param actions set to the descriptor operations, allocated from the arena
+ * @return int - number of operations, or -1 if a redirection failed
+ */
+int openRedirects(Command *cmd, int index, int inFd, int outFd, FdAction **actions)
+{
+  Stage *stage = &cmd->stages[index];
+  FdAction *list = allocate(&commandArena, (stage->redirectCount + 4) * sizeof(FdAction));
+  int count = 0;
+
+  if (inFd != -1)
+  {
+    list[count++] = (FdAction){0, inFd, false};
+  }
+  if (outFd != -1)
+  {
+    list[count++] = (FdAction){1, outFd, false};
+  }
+  if (cmd->background)
+  {
+    Redirect devNull[2] = {{REDIRECT_READ, 0, -1, "/dev/null"}, {REDIRECT_WRITE, 1, -1, "/dev/null"}};
+    for (int fd = 0; fd < 2; fd++)
+    {
+      // a coprocess is connected to small shell by pipes instead
+      if (fd == 0 ? index != 0 || inFd != -1 : index != cmd->stageCount - 1 || outFd != -1)
+      {
+        continue;
+      }
+      int file = openRedirect(&devNull[fd]);
+      if (file != -1)
+      {
+        list[count++] = (FdAction){fd, file, true};
+      }
+    }
+  }
+
+  for (int i = 0; i < stage->redirectCount; i++)
+  {
+    Redirect *redirect = &stage->redirects[i];
+    if (redirect->kind == REDIRECT_DUP || redirect->kind == REDIRECT_CLOSE)
+    {
+      list[count++] = (FdAction){redirect->fd, redirect->kind == REDIRECT_DUP ? redirect->source : -1, false};
+      continue;
+    }
+    int file = openRedirect(redirect);
+    if (file == -1)
+    {
+      closeRedirects(list, count);
+      return -1;
+    }
+    list[count++] = (FdAction){redirect->fd, file, true};
+  }
+
+  *actions = list;
+  return count;
+}
+
+/**
+ * @brief Opens the file, or creates the memfd holding the here-string, of a
+ *        redirection, reporting any error by filename.
+ *
+ * @param redirect redirection to open
+ * @return int - descriptor at or above REDIRECT_FD_BASE, or -1 on failure
+ */
+int openRedirect(const Redirect *redirect)
+{
+  int fd;
+  if (redirect->kind == REDIRECT_STRING)
+  {
+    // a here-string is the word followed by a newline, read from the start
+    size_t length = strlen(redirect->target);
+    fd = memfd_create("here-string", MFD_CLOEXEC);
+    if (fd == -1 || write(fd, redirect->target, length) != (ssize_t)length || write(fd, "\n", 1) != 1 ||
+        lseek(fd, 0, SEEK_SET) == -1)
+    {
+      perror("Error creating here-string");
+      if (fd != -1)
+      {
+        close(fd);
+      }
+      return -1;
+    }
+  }
+  else
+  {
+    int flags = redirect->kind == REDIRECT_READ ? O_RDONLY
+                : redirect->kind == REDIRECT_APPEND ? O_WRONLY | O_CREAT | O_APPEND
+                                                    : O_WRONLY | O_CREAT | O_TRUNC;
+    fd = open(redirect->target, flags | O_CLOEXEC, 0644);
+    if (fd == -1)
+    {
+      fprintf(stderr, "%s: no such file or directory\n", redirect->target);
+      return -1;
+    }
+    if (redirect->kind == REDIRECT_READ)
+    {
+      posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+  }
+
+  if (fd < REDIRECT_FD_BASE)
+  {
+    int moved = fcntl(fd, F_DUPFD_CLOEXEC, REDIRECT_FD_BASE);
+    close(fd);
+    fd = moved;
+  }
+  return fd;
+}
+
+/**
+ * @brief Closes the descriptors opened for a stage's redirections, once the
+ *        child has its own copies.
+ *
+ * @param actions descriptor operations of the stage
+ * @param count number of descriptor operations
+ */
+void closeRedirects(FdAction *actions, int count)
+{
+  for (int i = 0; i < count; i++)
+  {
+    if (actions[i].owned)
+    {
+      close(actions[i].source);
+    }
+  }
+}
+
+/**
+ * @brief Parallel built-in, run as parallel [-j N] command [args...] ::: items...
+ *        Runs the command once per item with at most N children at a time,
+ *        defaulting to the number of online CPUs. Each {} in the command is
+ *        replaced by the item, or the item is appended if there is none. A new
+ *        child is started as soon as the reaper hands one back. The exit value
+ *        is the number of jobs which failed, up to 101.
+ *
+ *        Children stay in small shell's process group, so SIGINT from the
+ *        terminal reaches all of them, and stops any more from being started.
+ *
+ * @param argv arguments of the built-in
+ */
+void runParallel(char **argv)
+{
+  int workers = sysconf(_SC_NPROCESSORS_ONLN);
+  int i = 1;
+  if (argv[i] && strcmp(argv[i], "-j") == 0)
+  {
+    workers = argv[i + 1] ? atoi(argv[i + 1]) : 0;
+    i += 2;
+  }
+
+  // split the arguments into the command template and the items
+  char **template = &argv[i];
+  int templateLength = 0;
+  while (template[templateLength] && strcmp(template[templateLength], PARALLEL_ARGS) != 0)
+  {
+    templateLength++;
+  }
+  if (workers < 1 || templateLength == 0 || !template[templateLength])
+  {
+    fprintf(stderr, "usage: parallel [-j N] command [args...] ::: items...\n");
+    lastProcessStatus = 1;
+    return;
+  }
+  char **items = &template[templateLength + 1];
+
+  bool placeholder = false;
+  for (int j = 0; j < templateLength; j++)
+  {
+    placeholder = placeholder || strstr(template[j], "{}");
+  }
+
+  ParallelRun run = {allocate(&commandArena, workers * sizeof(pid_t)), workers, 0, 0, false};
+  memset(run.pids, 0, workers * sizeof(pid_t));
+  parallelRun = &run;
+  fflush(stdout);
+
+  for (char **item = items; *item || run.running > 0;)
+  {
+    // start children until every worker is busy
+    while (*item && !run.interrupted && run.running < run.workers)
+    {
+      // build the command for this item as a single stage pipeline
+      Command cmd = {NULL, 0, false, LIST_END};
+      int capacity = 0;
+      Stage *stage = addStage(&cmd, &capacity);
+      for (int j = 0; j < templateLength; j++)
+      {
+        Buffer word = {NULL, 0, 0};
+        for (const char *p = template[j]; *p;)
+        {
+          const char *next = strstr(p, "{}");
+          appendBuffer(&word, p, next ? (size_t)(next - p) : strlen(p));
+          if (!next)
+          {
+            break;
+          }
+          appendBuffer(&word, *item, strlen(*item));
+          p = next + 2;
+        }
+        appendBuffer(&word, "", 1);
+        addArgument(stage, word.data);
+      }
+      if (!placeholder)
+      {
+        addArgument(stage, *item);
+      }
+      item++;
+
+      // a command beginning with pin places this job alone
+      const Placement *outer = placement;
+      Placement place;
+      if (strcmp(stage->argv[0], PIN) == 0)
+      {
+        if (!parsePlacement(stage, &place))
+        {
+          run.failures++;
+          continue;
+        }
+        placement = &place;
+      }
+      bool spawn = !forkOnly && !placement && !commandLimitMask;
+      pid_t pid = spawn ? spawnStage(&cmd, 0, -1, -1, -1) : forkStage(&cmd, 0, -1, -1, -1);
+      placement = outer;
+      if (pid == -1)
+      {
+        run.failures++;
+        continue;
+      }
+      int worker = 0;
+      while (run.pids[worker] != 0)
+      {
+        worker++;
+      }
+      run.pids[worker] = pid;
+      run.running++;
+    }
+
+    // drop the remaining items once interrupted
+    while (run.interrupted && *item)
+    {
+      item++;
+    }
+    if (run.running > 0)
+    {
+      waitForChild();
+    }
+  }
+
+  parallelRun = NULL;
+  lastProcessStatus = run.failures > PARALLEL_MAX_STATUS ? PARALLEL_MAX_STATUS : run.failures;
+}
+
+/**
+ * @brief Called by the reaper for a child which does not belong to a job,
+ *        recording its result if it belongs to the running parallel built-in.
+ *
+ * @param pid pid of the reaped child
+ * @param status wait status of the child
+ */
+void reapParallel(pid_t pid, int status)
+{
+  if (!parallelRun)
+  {
+    return;
+  }
+  for (int i = 0; i < parallelRun->workers; i++)
+  {
+    if (parallelRun->pids[i] == pid)
+    {
+      parallelRun->pids[i] = 0;
+      parallelRun->running--;
+      parallelRun->failures += status != 0;
+      parallelRun->interrupted = parallelRun->interrupted || (WIFSIGNALED(status) && WTERMSIG(status) == SIGINT);
+      return;
+    }
+  }
+}
+
+/**
+ * @brief Waits for every process of a foreground pipeline at once by waiting
+ *        on its process group, then takes back the terminal. The exit status of
+ *        the last stage becomes the status of the pipeline, and the resources
+ *        used by every stage are recorded for status -v. Under job control, a
+ *        pipeline stopped by Ctrl-Z becomes a stopped job, which fg and bg
+ *        continue.
+ *
+ * @param cmd command struct containing parsed pipeline stages
+ * @param pgid process group of the pipeline
+ * @param pids pids of the pipeline's processes, in stage order
+ * @param count number of processes in the pipeline
+ * @param last pid of the last stage, or -1 if it failed to launch
+ * @param started time the pipeline was launched
+ */
+void waitForeground(Command *cmd, pid_t pgid, pid_t *pids, int count, pid_t last,
+                    const struct timespec *started)
+{
+  int processStatus = 0;
+  int stopStatus = 0;
+  int *statuses = allocate(&commandArena, count * sizeof(int));
+  bool *reaped = allocate(&commandArena, count * sizeof(bool));
+  memset(reaped, 0, count * sizeof(bool));
+  lastUsage = (Usage){0};
+  for (int running = count; running > 0 && !stopStatus;)
+  {
+    int status;
+    struct rusage rusage;
+    pid_t pid = wait4(notifyImmediately ? -1 : -pgid, &status, terminal ? WUNTRACED : 0, &rusage);
+    if (pid == -1)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      break;
+    }
+
+    // with set -b, background jobs finishing meanwhile are reported at once
+    Job *job = notifyImmediately ? findJob(pid) : NULL;
+    if (job)
+    {
+      if (WIFSTOPPED(status))
+      {
+        job->stopped = true;
+      }
+      else
+      {
+        reapProcess(pid, status, &rusage);
+      }
+      continue;
+    }
+    if (WIFSTOPPED(status))
+    {
+      stopStatus = status;
+      break;
+    }
+    if (pid == last)
+    {
+      processStatus = status;
+    }
+    for (int i = 0; i < count; i++)
+    {
+      if (pids[i] == pid)
+      {
+        reaped[i] = true;
+        statuses[i] = status;
+      }
+    }
+    addUsage(&lastUsage, &rusage);
+    running--;
+  }
+  lastUsage.real = elapsedSince(started);
+
+  if (stopStatus)
+  {
+    // keep the pipeline as a job, accounting for the processes already reaped
+    Job *job = addJob(pgid, pids, count, describeCommand(cmd));
+    job->started = *started;
+    for (int i = 0; i < count; i++)
+    {
+      if (reaped[i])
+      {
+        reapProcess(pids[i], statuses[i], &(struct rusage){0});
+      }
+    }
+    job->usage = lastUsage;
+    suspendJob(job);
+    lastProcessStatus = 128 + WSTOPSIG(stopStatus);
+    lastSignal = 0;
+    return;
+  }
+
+  if (terminal)
+  {
+    tcsetpgrp(STDIN_FILENO, getpgrp());
+  }
+
+  // if process was terminated by a signal, print out the termination status
+  if (WIFSIGNALED(processStatus))
+  {
+    printf("terminated by signal %d\n", WTERMSIG(processStatus));
+    flushOutput();
+  }
+  // update the process exit status
+  lastProcessStatus = exitCode(processStatus);
+  lastSignal = WIFSIGNALED(processStatus) ? WTERMSIG(processStatus) : 0;
+}
+
+//=============================================================================
+// Lexing and parsing
+//=============================================================================
+
+/**
+ * @brief Lexes and parses the next command of a line of raw CLI input in a
+ *        single pass. Words are separated by blanks (spaces or tabs), and the
+ *        operators |, <, >, &, ;, && and || need no surrounding blanks. A pipe
+ *        character ends a pipeline stage, and a redirection character takes the
+ *        following word as its filename. A list operator ends the command -
+ *        an ampersand also runs it in the background, unless foreground only
+ *        mode is on. A # at the start of a word begins a comment.
+ *
+ * @param line raw cli input from user, advanced past the command
+ * @param cmd command struct receiving the parsed pipeline
+ * @return int - number of stages, or -1 on a syntax error
+ */
+int parseLine(const char **line, Command *cmd)
+{
+  *cmd = (Command){NULL, 0, false, LIST_END};
+  int capacity = 0;
+  Stage *stage = addStage(cmd, &capacity);
+  const char *input = *line;
+
+  while (true)
+  {
+    input += strspn(input, BLANKS);
+    char c = *input;
+    if (c == '\0' || c == '#')
+    {
+      break;
+    }
+
+    // a list operator ends the command
+    if (c == ';' || (c == '&' && input[1] == '&') || (c == '|' && input[1] == '|') || c == '&')
+    {
+      const char *operator = c == ';' ? ";" : input[1] == c ? (c == '&' ? "&&" : "||") : "&";
+      if (stage->argc == 0)
+      {
+        fprintf(stderr, "syntax error near %s\n", operator);
+        return -1;
+      }
+      input += strlen(operator);
+      cmd->background = c == '&' && !operator[1] && !foregroundOnly;
+      cmd->next = c == ';' || !operator[1] ? LIST_ALWAYS : c == '&' ? LIST_AND : LIST_OR;
+
+      // ; and & may end the line, while && and || need another command
+      input += strspn(input, BLANKS);
+      if (*input == '\0' || *input == '#')
+      {
+        if (operator[1])
+        {
+          fprintf(stderr, "syntax error near newline\n");
+          return -1;
+        }
+        cmd->next = LIST_END;
+      }
+      break;
+    }
+
+    // a pipe character ends the current stage and starts the next
+    if (c == '|')
+    {
+      if (stage->argc == 0)
+      {
+        fprintf(stderr, "syntax error near |\n");
+        return -1;
+      }
+      input++;
+      stage = addStage(cmd, &capacity);
+      continue;
+    }
+
+    // a redirection operator, optionally after a descriptor number, takes the
+    // next word, unsplit, as its filename
+    if (c == '<' || c == '>' || (isdigit((unsigned char)c) && (input[1] == '<' || input[1] == '>')))
+    {
+      if (parseRedirect(&input, stage) == -1)
+      {
+        return -1;
+      }
+      continue;
+    }
+
+    // anything else is a word, which expansion may split into several
+    Buffer words = {NULL, 0, 0};
+    int count = lexWord(&input, &words, true);
+    if (count == -1)
+    {
+      return -1;
+    }
+    char *word = words.data;
+    for (int i = 0; i < count; i++)
+    {
+      addArgument(stage, word);
+      word = nextWord(word, words.data + words.length);
+    }
+  }
+
+  // a redirection needs a program, as does every stage of a pipeline
+  if (stage->argc == 0 && (cmd->stageCount > 1 || stage->redirectCount > 0))
+  {
+    fprintf(stderr, "syntax error near %s\n", cmd->stageCount > 1 ? "|" : "newline");
+    return -1;
+  }
+  *line = input;
+  return cmd->stageCount;
+}
+
+/**
+ * @brief Lexes a single word, which may be made up of plain characters,
+ *        'single quoted' text taken literally, "double quoted" text in which
+ *        variables are expanded and \ escapes $, " and \, and characters
+ *        escaped with \. Runs of plain characters are found with strcspn,
+ *        which libc implements with vector instructions, and copied in bulk.
+ *
+ *        The word is written into a buffer as NUL terminated strings. When
+ *        splitting, the value of an unquoted variable is split at blanks into
+ *        several words, so the buffer may hold more than one - or none, if
+ *        the variable expanded to nothing.
+ *
+ * @param input position of the word, advanced past it
+ * @param out buffer receiving the word
+ * @param split whether to split unquoted variables into several words
+ * @return int - number of words, or -1 on a syntax error
+ */
+int lexWord(const char **input, Buffer *out, bool split)
+{
+  const char *p = *input;
+  size_t start = 0;   // offset of the current word within out
+  bool quoted = false; // whether the current word contains quotes
+  int count = 0;
+
+  while (true)
+  {
+    // copy everything up to the next character with a special meaning
+    size_t run = strcspn(p, WORD_DELIMITERS);
+    appendBuffer(out, p, run);
+    p += run;
+
+    if (*p == '\'')
+    {
+      const char *close = strchr(p + 1, '\'');
+      if (!close)
+      {
+        fprintf(stderr, "syntax error: unterminated quote\n");
+        return -1;
+      }
+      appendBuffer(out, p + 1, close - p - 1);
+      p = close + 1;
+      quoted = true;
+    }
+    else if (*p == '"')
+    {
+      p++;
+      while (*p != '"')
+      {
+        run = strcspn(p, QUOTED_DELIMITERS);
+        appendBuffer(out, p, run);
+        p += run;
+        if (*p == '\0')
+        {
+          fprintf(stderr, "syntax error: unterminated quote\n");
+          return -1;
+        }
+        if (*p == '\\')
+        {
+          bool escapes = p[1] == '$' || p[1] == '"' || p[1] == '\\';
+          appendBuffer(out, p + escapes, 1);
+          p += 1 + escapes;
+        }
+        else if (*p == EXPAND)
+        {
+          expandVariable(&p, out);
+        }
+      }
+      p++;
+      quoted = true;
+    }
+    else if (*p == '\\')
+    {
+      if (p[1])
+      {
+        appendBuffer(out, p + 1, 1);
+        p += 2;
+      }
+      else
+      {
+        p++;
+      }
+    }
+    else if (*p == EXPAND)
+    {
+      size_t from = out->length;
+      expandVariable(&p, out);
+      if (!split)
+      {
+        continue;
+      }
+
+      // split the expansion at blanks, ending the current word at each run of
+      // blanks - unless nothing has been written to it yet
+      size_t kept = from;
+      for (size_t i = from; i < out->length; i++)
+      {
+        char c = out->data[i];
+        if (c != ' ' && c != '\t' && c != '\n')
+        {
+          out->data[kept++] = c;
+        }
+        else if (kept > start || quoted)
+        {
+          out->data[kept++] = '\0';
+          start = kept;
+          quoted = false;
+          count++;
+        }
+      }
+      out->length = kept;
+    }
+    else
+    {
+      break;
+    }
+  }
+
+  *input = p;
+  if (out->length > start || quoted)
+  {
+    appendBuffer(out, "", 1);
+    count++;
+  }
+  return count;
+}
+
+/**
+ * @brief Parses a redirection - [n]<, [n]>, [n]>>, [n]<<<, or [n]>&m, [n]<&m
+ *        and [n]>&- to duplicate or close a descriptor. n defaults to 0 for
+ *        input and 1 for output.
+ *
+ * @param input position of the redirection, advanced past it
+ * @param stage stage receiving the redirection
+ * @return int - 0, or -1 on a syntax error
+ */
+int parseRedirect(const char **input, Stage *stage)
+{
+  const char *p = *input;
+  int fd = -1;
+  if (isdigit((unsigned char)*p))
+  {
+    fd = *p++ - '0';
+  }
+  char c = *p++;
+  RedirectKind kind = c == '<' ? REDIRECT_READ : REDIRECT_WRITE;
+  if (c == '>' && *p == '>')
+  {
+    kind = REDIRECT_APPEND;
+    p++;
+  }
+  else if (c == '<' && p[0] == '<' && p[1] == '<')
+  {
+    kind = REDIRECT_STRING;
+    p += 2;
+  }
+  else if (c == '<' && *p == '<')
+  {
+    fprintf(stderr, "syntax error: here-documents are not supported\n");
+    return -1;
+  }
+  else if (*p == '&')
+  {
+    kind = REDIRECT_DUP;
+    p++;
+  }
+  fd = fd == -1 ? c == '>' : fd;
+
+  p += strspn(p, BLANKS);
+  Buffer word = {NULL, 0, 0};
+  int words = lexWord(&p, &word, false);
+  *input = p;
+  if (words == -1)
+  {
+    return -1;
+  }
+  if (words == 0)
+  {
+    fprintf(stderr, "syntax error: missing %s after %c\n", kind == REDIRECT_STRING ? "word" : "filename", c);
+    return -1;
+  }
+
+  // a duplication names a single digit descriptor, or - to close
+  int source = -1;
+  if (kind == REDIRECT_DUP)
+  {
+    if (strcmp(word.data, "-") == 0)
+    {
+      kind = REDIRECT_CLOSE;
+    }
+    else if (isdigit((unsigned char)word.data[0]) && !word.data[1])
+    {
+      source = word.data[0] - '0';
+    }
+    else
+    {
+      fprintf(stderr, "syntax error: %s: bad file descriptor\n", word.data);
+      return -1;
+    }
+  }
+  addRedirect(stage, kind, fd, source, word.data);
+  return 0;
+}
+
+/**
+ * @brief Appends a redirection to a stage's list, doubling it as needed.
+ *
+ * @param stage stage receiving the redirection
+ * @param kind kind of redirection
+ * @param fd descriptor being redirected
+ * @param source descriptor copied by a duplication, or -1
+ * @param target filename or here-string
+ */
+void addRedirect(Stage *stage, RedirectKind kind, int fd, int source, char *target)
+{
+  if (stage->redirectCount == stage->redirectCapacity)
+  {
+    int grown = stage->redirectCapacity ? stage->redirectCapacity * 2 : 2;
+    stage->redirects = reallocate(&commandArena, stage->redirects, stage->redirectCapacity * sizeof(Redirect),
+                                  grown * sizeof(Redirect));
+    stage->redirectCapacity = grown;
+  }
+  stage->redirects[stage->redirectCount++] = (Redirect){kind, fd, source, target};
+}
+
+/**
+ * @brief Steps over a NUL terminated word within a buffer of words.
+ *
+ * @param words current word
+ * @param end end of the buffer
+ * @return char* - the following word
+ */
+char *nextWord(char *words, char *end)
+{
+  return (char *)memchr(words, '\0', end - words) + 1;
+}
+
+/**
+ * @brief Appends a new, empty stage to a command's pipeline, doubling the
+ *        array of stages as needed.
+ *
+ * @param cmd command struct receiving the stage
+ * @param capacity capacity of the command's array of stages
+ * @return Stage* - the new stage
+ */
+Stage *addStage(Command *cmd, int *capacity)
+{
+  if (cmd->stageCount == *capacity)
+  {
+    int grown = *capacity ? *capacity * 2 : 4;
+    cmd->stages = reallocate(&commandArena, cmd->stages, *capacity * sizeof(Stage), grown * sizeof(Stage));
+    *capacity = grown;
+  }
+
+  Stage *stage = &cmd->stages[cmd->stageCount++];
+  *stage = (Stage){NULL, 0, 4, NULL, 0, 0};
+  stage->argv = allocate(&commandArena, (stage->capacity + 1) * sizeof(char *));
+  stage->argv[0] = NULL;
+  return stage;
+}
+
+/**
+ * @brief Appends an argument to a stage's argv, keeping it NULL terminated and
+ *        doubling it as needed.
+ *
+ * @param stage stage receiving the argument
+ * @param word argument to append
+ */
+void addArgument(Stage *stage, char *word)
+{
+  if (stage->argc == stage->capacity)
+  {
+    stage->argv = reallocate(&commandArena, stage->argv, (stage->capacity + 1) * sizeof(char *),
+                             (stage->capacity * 2 + 1) * sizeof(char *));
+    stage->capacity *= 2;
+  }
+  stage->argv[stage->argc++] = word;
+  stage->argv[stage->argc] = NULL;
+}
+
+/**
+ * @brief SIGTSTP handler which requests entry or exit from foreground only
+ *        mode. Only an async-signal-safe counter is updated - the program loop
+ *        applies the change and prints the mode's status.
+ *
+ * @param signo signal number (unused)
+ */
+void foregroundOnlyMode(int signo)
+{
+  (void)signo;
+  foregroundToggles++;
+}
+
+/**
+ * @brief Applies each entry or exit from foreground only mode requested by
+ *        SIGTSTP since the last check, changing the program's foreground state
+ *        and printing its status.
+ */
+void checkForegroundMode()
+{
+  while (handledToggles != foregroundToggles)
+  {
+    handledToggles++;
+    foregroundOnly = !foregroundOnly;
+    announceForegroundMode();
+  }
+}
+
+/**
+ * @brief Prints whether foreground only mode has been entered or exited.
+ */
+void announceForegroundMode()
+{
+  printf(foregroundOnly ? "Entering Foreground only mode\n" : "Exiting Foreground only mode\n");
+  flushOutput();
+}
+
+//=============================================================================
+// Job table
+//=============================================================================
+
+/**
+ * @brief Adds a background pipeline to the job table, reusing a free slot if
+ *        one is available, and indexes each of its processes by pid.
+ *
+ * @param pgid process group of the pipeline
+ * @param pids pids of the pipeline's processes, in stage order
+ * @param count number of processes
+ * @param command text of the pipeline
+ * @return Job* - the new job
+ */
+Job *addJob(pid_t pgid, pid_t *pids, int count, const char *command)
+{
+  if (jobTable.freeList == -1)
+  {
+    growJobTable();
+  }
+  while ((jobTable.processCount + count) * 2 > (1 << jobTable.indexBits))
+  {
+    growJobIndex();
+  }
+
+  // pop a slot off the free list and push it onto the front of the live list
+  int slot = jobTable.freeList;
+  Job *job = &jobTable.jobs[slot];
+  jobTable.freeList = job->next;
+
+  job->processes = malloc(count * sizeof(Process));
+  if (!job->processes)
+  {
+    perror("Error allocating job");
+    exit(1);
+  }
+  for (int i = 0; i < count; i++)
+  {
+    job->processes[i] = (Process){pids[i], openPidfd(pids[i]), false};
+  }
+  job->command = strdup(command);
+  clock_gettime(CLOCK_MONOTONIC, &job->started);
+  job->pgid = pgid;
+  job->processCount = count;
+  job->running = count;
+  job->status = 0;
+  job->usage = (Usage){0};
+  job->active = true;
+  job->stopped = false;
+  job->foreground = false;
+  job->modesSaved = false;
+  job->cgroupFd = -1;
+  job->cgroupId = 0;
+  job->client = -1;
+  job->prev = -1;
+  job->next = jobTable.liveList;
+  if (jobTable.liveList != -1)
+  {
+    jobTable.jobs[jobTable.liveList].prev = slot;
+  }
+  jobTable.liveList = slot;
+  jobTable.count++;
+
+  for (int i = 0; i < count; i++)
+  {
+    indexJob(pids[i], slot);
+  }
+  jobTable.processCount += count;
+  return job;
+}
+
+/**
+ * @brief Looks up the job belonging to a pid.
+ *
+ * @param pid pid to look up
+ * @return Job* - the matching job, or NULL if the pid isn't a background job
+ */
+Job *findJob(pid_t pid)
+{
+  // pid 0 marks empty index entries, and no job has a negative pid
+  if (!jobTable.index || pid <= 0)
+  {
+    return NULL;
+  }
+  unsigned mask = (1u << jobTable.indexBits) - 1;
+  for (unsigned i = jobHash(pid);; i = (i + 1) & mask)
+  {
+    JobIndexEntry *entry = &jobTable.index[i];
+    if (entry->pid == pid)
+    {
+      return &jobTable.jobs[entry->slot];
+    }
+    if (entry->pid == 0)
+    {
+      return NULL;
+    }
+  }
+}
+
+/**
+ * @brief Looks up a job by the pid of any of its processes, or by job id as %n.
+ *
+ * @param spec pid or %job
+ * @return Job* - the matching job, or NULL if there is none
+ */
+Job *lookupJob(const char *spec)
+{
+  const char *digits = spec + (spec[0] == '%');
+  char *end;
+  long id = strtol(digits, &end, 10);
+  if (end == digits || *end || id <= 0 || (pid_t)id != id)
+  {
+    return NULL;
+  }
+  if (digits == spec)
+  {
+    return findJob(id);
+  }
+  if (id < 1 || id > jobTable.capacity || !jobTable.jobs[id - 1].active)
+  {
+    return NULL;
+  }
+  return &jobTable.jobs[id - 1];
+}
+
+/**
+ * @brief Finds the oldest job, towards the tail of the live list.
+ *
+ * @param running whether to skip stopped jobs
+ * @return Job* - the oldest job, or NULL if there are none
+ */
+Job *oldestJob(bool running)
+{
+  Job *oldest = NULL;
+  for (int slot = jobTable.liveList; slot != -1; slot = jobTable.jobs[slot].next)
+  {
+    if (!running || !jobTable.jobs[slot].stopped)
+    {
+      oldest = &jobTable.jobs[slot];
+    }
+  }
+  return oldest;
+}
+
+/**
+ * @brief Finds the job fg and bg act on without an argument - the newest job,
+ *        at the head of the live list.
+ *
+ * @param stopped whether to skip jobs which are running
+ * @return Job* - the newest job, or NULL if there are none
+ */
+Job *currentJob(bool stopped)
+{
+  for (int slot = jobTable.liveList; slot != -1; slot = jobTable.jobs[slot].next)
+  {
+    if (!stopped || jobTable.jobs[slot].stopped)
+    {
+      return &jobTable.jobs[slot];
+    }
+  }
+  return NULL;
+}
+
+/**
+ * @brief Records that a job has been stopped. If it had the terminal, its
+ *        terminal settings are saved for fg to restore, and the terminal
+ *        is taken back along with small shell's own settings.
+ *
+ * @param job stopped job
+ */
+void suspendJob(Job *job)
+{
+  job->stopped = true;
+  job->foreground = false;
+  if (terminal)
+  {
+    job->modesSaved = tcgetattr(STDIN_FILENO, &job->modes) == 0;
+    tcsetpgrp(STDIN_FILENO, getpgrp());
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &shellModes);
+  }
+  printf("\n[%d] %d Stopped %s\n", job->id, job->pgid, job->command);
+  flushOutput();
+}
+
+/**
+ * @brief Blocks in waitpid on a job's process group, or on the pids of any of
+ *        its processes which have left the group, until all of them have been
+ *        reaped, reporting it like any other finished background job. The job
+ *        may instead be stopped, and is then left in the job table, with the
+ *        terminal taken back if it had it.
+ *
+ * @param job job to wait for
+ * @param foreground whether the job has the terminal, as under fg
+ * @return int - exit code of the job's last stage, 128 plus the signal if it
+ *         was terminated or stopped by one, or -1 if the wait was interrupted
+ *         by SIGINT
+ */
+int waitJob(Job *job, bool foreground)
+{
+  pid_t pgid = job->pgid;
+  while (true)
+  {
+    int status;
+    struct rusage rusage;
+    pid_t pid = wait4(-pgid, &status, WUNTRACED, &rusage);
+
+    // a process which has left the job's process group, as with setsid, can
+    // only be waited for by its pid
+    for (int i = 0; pid == -1 && errno == ECHILD && i < job->processCount; i++)
+    {
+      if (!job->processes[i].reaped)
+      {
+        pid = wait4(job->processes[i].pid, &status, WUNTRACED, &rusage);
+      }
+    }
+    if (pid == -1)
+    {
+      if (errno == EINTR && !waitInterrupted)
+      {
+        continue;
+      }
+      return errno == EINTR ? -1 : 1;
+    }
+    if (WIFSTOPPED(status))
+    {
+      if (foreground)
+      {
+        suspendJob(job);
+      }
+      job->stopped = true;
+      return 128 + WSTOPSIG(status);
+    }
+
+    // the job is removed once its last process is reaped, so check first
+    bool finished = job->running == 1;
+    int jobStatus = job->processes[job->processCount - 1].pid == pid ? status : job->status;
+    reapProcess(pid, status, &rusage);
+    if (finished)
+    {
+      return exitCode(jobStatus);
+    }
+  }
+}
+
+/**
+ * @brief Removes a job from the job table, returning its slot to the free
+ *        list. Once the table is empty its memory is released.
+ *
+ * @param job job to remove
+ */
+void removeJob(Job *job)
+{
+  int slot = job->id - 1;
+  for (int i = 0; i < job->processCount; i++)
+  {
+    if (!job->processes[i].reaped)
+    {
+      unindexJob(job->processes[i].pid);
+      close(job->processes[i].pidfd);
+    }
+  }
+  free(job->processes);
+  free(job->command);
+  removeJobCgroup(job);
+
+  // unlink from the live list and push onto the free list
+  if (job->prev != -1)
+  {
+    jobTable.jobs[job->prev].next = job->next;
+  }
+  else
+  {
+    jobTable.liveList = job->next;
+  }
+  if (job->next != -1)
+  {
+    jobTable.jobs[job->next].prev = job->prev;
+  }
+  job->active = false;
+  job->next = jobTable.freeList;
+  jobTable.freeList = slot;
+  jobTable.count--;
+
+  if (jobTable.count == 0)
+  {
+    free(jobTable.jobs);
+    free(jobTable.index);
+    jobTable = (JobTable){NULL, 0, 0, 0, -1, -1, NULL, 0};
+  }
+}
+
+/**
+ * @brief Doubles the capacity of the job slab, chaining the new slots onto the
+ *        free list in ascending order so low job ids are handed out first.
+ */
+void growJobTable()
+{
+  int capacity = jobTable.capacity ? jobTable.capacity * 2 : 8;
+  Job *jobs = realloc(jobTable.jobs, capacity * sizeof(Job));
+  if (!jobs)
+  {
+    perror("Error allocating job table");
+    exit(1);
+  }
+
+  for (int i = jobTable.capacity; i < capacity; i++)
+  {
+    jobs[i].id = i + 1;
+    jobs[i].active = false;
+    jobs[i].next = i + 1 < capacity ? i + 1 : jobTable.freeList;
+  }
+  jobTable.freeList = jobTable.capacity;
+  jobTable.jobs = jobs;
+  jobTable.capacity = capacity;
+}
+
+/**
+ * @brief Doubles the size of the pid index and rehashes every active job.
+ */
+void growJobIndex()
+{
+  int bits = jobTable.indexBits ? jobTable.indexBits + 1 : 4;
+  JobIndexEntry *index = calloc((size_t)1 << bits, sizeof(JobIndexEntry));
+  if (!index)
+  {
+    perror("Error allocating job index");
+    exit(1);
+  }
+
+  free(jobTable.index);
+  jobTable.index = index;
+  jobTable.indexBits = bits;
+  for (int i = jobTable.liveList; i != -1; i = jobTable.jobs[i].next)
+  {
+    for (int j = 0; j < jobTable.jobs[i].processCount; j++)
+    {
+      if (!jobTable.jobs[i].processes[j].reaped)
+      {
+        indexJob(jobTable.jobs[i].processes[j].pid, i);
+      }
+    }
+  }
+}
+
+/**
+ * @brief Inserts a pid into the job index using linear probing.
+ *
+ * @param pid pid to insert
+ * @param slot job table slot of the pid's job
+ */
+void indexJob(pid_t pid, int slot)
+{
+  unsigned mask = (1u << jobTable.indexBits) - 1;
+  unsigned i = jobHash(pid);
+  while (jobTable.index[i].pid != 0)
+  {
+    i = (i + 1) & mask;
+  }
+  jobTable.index[i].pid = pid;
+  jobTable.index[i].slot = slot;
+}
+
+/**
+ * @brief Removes a pid from the job index, shifting later entries of the same
+ *        probe sequence back so lookups never need tombstones.
+ *
+ * @param pid pid to remove
+ */
+void unindexJob(pid_t pid)
+{
+  unsigned mask = (1u << jobTable.indexBits) - 1;
+  unsigned i = jobHash(pid);
+  while (jobTable.index[i].pid != pid)
+  {
+    if (jobTable.index[i].pid == 0)
+    {
+      return;
+    }
+    i = (i + 1) & mask;
+  }
+
+  // backward shift deletion - move back any entry whose home slot lies
+  // cyclically at or before the hole
+  for (unsigned j = (i + 1) & mask; jobTable.index[j].pid != 0; j = (j + 1) & mask)
+  {
+    unsigned home = jobHash(jobTable.index[j].pid);
+    if (((j - home) & mask) >= ((j - i) & mask))
+    {
+      jobTable.index[i] = jobTable.index[j];
+      i = j;
+    }
+  }
+  jobTable.index[i].pid = 0;
+  jobTable.processCount--;
+}
+
+/**
+ * @brief Fibonacci hash of a pid into the job index.
+ *
+ * @param pid pid to hash
+ * @return unsigned - index of the pid's home entry
+ */
+unsigned jobHash(pid_t pid)
+{
+  return (uint32_t)((uint32_t)pid * 2654435761u) >> (32 - jobTable.indexBits);
+}
+
+//=============================================================================
+// Resource accounting
+//=============================================================================
+
+/**
+ * @brief Adds the resources used by a reaped process to a pipeline's usage.
+ *
+ * @param usage usage of the pipeline
+ * @param rusage resources used by the process, as returned by wait4
+ */
+void addUsage(Usage *usage, const struct rusage *rusage)
+{
+  usage->user += rusage->ru_utime.tv_sec + rusage->ru_utime.tv_usec / 1e6;
+  usage->system += rusage->ru_stime.tv_sec + rusage->ru_stime.tv_usec / 1e6;
+  usage->maxRss = rusage->ru_maxrss > usage->maxRss ? rusage->ru_maxrss : usage->maxRss;
+  usage->voluntarySwitches += rusage->ru_nvcsw;
+  usage->involuntarySwitches += rusage->ru_nivcsw;
+}
+
+/**
+ * @brief Prints resource usage one field per line, for time and status -v.
+ *        The max RSS is left out when no process was reaped to measure it.
+ *
+ * @param stream stream to print to
+ * @param usage usage to print
+ */
+void printUsage(FILE *stream, const Usage *usage)
+{
+  fprintf(stream, "real\t%.3fs\nuser\t%.3fs\nsys\t%.3fs\n", usage->real, usage->user, usage->system);
+  if (usage->maxRss)
+  {
+    fprintf(stream, "maxrss\t%ldK\n", usage->maxRss);
+  }
+  fprintf(stream, "ctxsw\t%ld voluntary, %ld involuntary\n", usage->voluntarySwitches,
+          usage->involuntarySwitches);
+  fflush(stream);
+}
+
+/**
+ * @brief Queues the completion of a background job to be reported. A full
+ *        queue is drained first, and with set -b the completion is reported
+ *        straight away.
+ *
+ * @param pgid process group of the job
+ * @param status wait status of its last stage
+ * @param usage resources used by the job
+ */
+void queueNotification(pid_t pgid, int status, const Usage *usage)
+{
+  if (notifications.queued - notifications.written == NOTIFY_QUEUE_SIZE)
+  {
+    drainNotifications();
+  }
+  notifications.entries[notifications.queued++ % NOTIFY_QUEUE_SIZE] = (Notification){pgid, status, *usage};
+  if (notifyImmediately)
+  {
+    drainNotifications();
+  }
+}
+
+/**
+ * @brief Reports every queued job completion, with its exit value or the
+ *        signal which terminated it and its resource usage on the same line.
+ *        The messages are formatted up front and written with one writev,
+ *        after anything already buffered by stdio.
+ */
+void drainNotifications()
+{
+  if (notifications.written == notifications.queued)
+  {
+    return;
+  }
+  char lines[NOTIFY_QUEUE_SIZE][192];
+  struct iovec iov[NOTIFY_QUEUE_SIZE];
+  int count = 0;
+  for (; notifications.written != notifications.queued; notifications.written++, count++)
+  {
+    const Notification *entry = &notifications.entries[notifications.written % NOTIFY_QUEUE_SIZE];
+    const Usage *usage = &entry->usage;
+    bool signalled = WIFSIGNALED(entry->status);
+    int length = snprintf(lines[count], sizeof(lines[count]),
+                          "Background pid %d is done: %s %d (real %.2fs, user %.2fs, sys %.2fs, maxrss %ldK)\n",
+                          entry->pgid, signalled ? "terminated by signal" : "exit value",
+                          signalled ? WTERMSIG(entry->status) : WEXITSTATUS(entry->status), usage->real,
+                          usage->user, usage->system, usage->maxRss);
+    size_t size = sizeof(lines[count]);
+    iov[count] = (struct iovec){lines[count], (size_t)length < size ? (size_t)length : size - 1};
+  }
+
+  fflush(stdout);
+  for (int i = 0; i < count;)
+  {
+    ssize_t written = writev(STDOUT_FILENO, iov + i, count - i);
+    if (written == -1 && errno != EINTR)
+    {
+      return;
+    }
+
+    // skip past what was written, resuming within a partly written message
+    for (; i < count && written >= (ssize_t)iov[i].iov_len; i++)
+    {
+      written -= iov[i].iov_len;
+    }
+    if (i < count && written > 0)
+    {
+      iov[i].iov_base = (char *)iov[i].iov_base + written;
+      iov[i].iov_len -= written;
+    }
+  }
+}
+
+/**
+ * @brief Converts a wait status into an exit code, with 128 plus the signal
+ *        number for processes terminated by a signal.
+ *
+ * @param status wait status
+ * @return int - the exit code
+ */
+int exitCode(int status)
+{
+  return WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status);
+}
+
+/**
+ * @brief Measures the wall clock time since an earlier CLOCK_MONOTONIC time.
+ *
+ * @param start earlier time
+ * @return double - elapsed seconds
+ */
+double elapsedSince(const struct timespec *start)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+//=============================================================================
+// Resource limits and placement
+//=============================================================================
+
+/**
+ * @brief Ulimit built-in, run as ulimit [-SH] [-a | -cdflmnstuv] [limit].
+ *        Shows or sets a resource limit of the commands small shell launches
+ *        afterwards, which each child applies before executing its program;
+ *        small shell itself, and the built-ins it runs, keep their own limits,
+ *        from which the limits shown start out. The file size limit is used
+ *        when no limit is named, and setting a limit without -S or -H sets
+ *        both the soft and hard limits. A limit is a number of the units shown
+ *        by -a, or unlimited.
+ *
+ * @param argv arguments of the built-in
+ */
+void setLimits(char **argv)
+{
+  bool soft = false;
+  bool hard = false;
+  bool all = false;
+  const Limit *limit = findLimit('f');
+  const char *value = NULL;
+  lastProcessStatus = 0;
+  for (int i = 1; argv[i]; i++)
+  {
+    for (const char *option = argv[i] + 1; argv[i][0] == '-' && *option; option++)
+    {
+      soft = soft || *option == 'S';
+      hard = hard || *option == 'H';
+      all = all || *option == 'a';
+      if (!strchr("SHa", *option) && !(limit = findLimit(*option)))
+      {
+        fprintf(stderr, "ulimit: -%c: invalid option\n", *option);
+        lastProcessStatus = 2;
+        return;
+      }
+    }
+    if (argv[i][0] != '-' || !argv[i][1])
+    {
+      if (value)
+      {
+        fprintf(stderr, "usage: ulimit [-SH] [-a | -cdflmnstuv] [limit]\n");
+        lastProcessStatus = 2;
+        return;
+      }
+      value = argv[i];
+    }
+  }
+
+  // show the soft limits unless the hard limits are asked for
+  if (all || !value)
+  {
+    for (int i = 0; i < LIMIT_COUNT; i++)
+    {
+      struct rlimit current;
+      if ((all || &LIMITS[i] == limit) && getCommandLimit(LIMITS[i].resource, &current))
+      {
+        rlim_t shown = hard ? current.rlim_max : current.rlim_cur;
+        if (all)
+        {
+          printf("%-28s(-%c) ", LIMITS[i].name, LIMITS[i].option);
+        }
+        if (shown == RLIM_INFINITY)
+        {
+          printf("unlimited\n");
+        }
+        else
+        {
+          printf("%llu\n", (unsigned long long)(shown / LIMITS[i].unit));
+        }
+      }
+    }
+    flushOutput();
+    return;
+  }
+
+  rlim_t units = RLIM_INFINITY;
+  if (strcmp(value, "unlimited") != 0)
+  {
+    char *end;
+    errno = 0;
+    unsigned long long number = strtoull(value, &end, 10);
+    if (!isdigit((unsigned char)*value) || *end || errno || number > (RLIM_INFINITY - 1) / limit->unit)
+    {
+      fprintf(stderr, "ulimit: %s: invalid limit\n", value);
+      lastProcessStatus = 1;
+      return;
+    }
+    units = number * limit->unit;
+  }
+
+  struct rlimit current;
+  getCommandLimit(limit->resource, &current);
+  if (soft || !hard)
+  {
+    current.rlim_cur = units;
+  }
+  if (hard || !soft)
+  {
+    current.rlim_max = units;
+  }
+
+  // try the limit in a throwaway child, which starts from small shell's limits
+  // as every command does, so that a limit the kernel refuses is reported here
+  // rather than by each command it would fail
+  pid_t pid = fork();
+  if (pid == 0)
+  {
+    _exit(setrlimit(limit->resource, &current) == -1 ? errno : 0);
+  }
+  int status = 0;
+  while (pid != -1 && waitpid(pid, &status, 0) == -1 && errno == EINTR)
+  {
+  }
+  int error = pid == -1 ? errno : WIFEXITED(status) ? WEXITSTATUS(status) : EAGAIN;
+  if (error)
+  {
+    fprintf(stderr, "ulimit: %s\n", strerror(error));
+    lastProcessStatus = 1;
+    return;
+  }
+  commandLimits[limit->resource] = current;
+  commandLimitMask |= 1u << limit->resource;
+}
+
+/**
+ * @brief Gets a resource limit of the commands small shell launches, which is
+ *        the one set by ulimit, or else small shell's own.
+ *
+ * @param resource RLIMIT_ constant
+ * @param limit set to the limit
+ * @return bool - whether the limit could be read
+ */
+bool getCommandLimit(int resource, struct rlimit *limit)
+{
+  if (commandLimitMask & (1u << resource))
+  {
+    *limit = commandLimits[resource];
+    return true;
+  }
+  return getrlimit(resource, limit) == 0;
+}
+
+/**
+ * @brief Runs within a forked child to apply the resource limits set by
+ *        ulimit, before executing the program. Exits the child if the kernel
+ *        rejects a limit, without flushing the stdio buffers shared with small
+ *        shell.
+ */
+void applyLimits()
+{
+  for (int resource = 0; commandLimitMask >> resource; resource++)
+  {
+    if ((commandLimitMask & (1u << resource)) && setrlimit(resource, &commandLimits[resource]) == -1)
+    {
+      perror("Error setting resource limit");
+      _exit(1);
+    }
+  }
+}
+
+/**
+ * @brief Looks up a resource limit by its ulimit option letter.
+ *
+ * @param option option letter
+ * @return const Limit* - the limit, or NULL if there is none
+ */
+const Limit *findLimit(char option)
+{
+  for (int i = 0; i < LIMIT_COUNT; i++)
+  {
+    if (LIMITS[i].option == option)
+    {
+      return &LIMITS[i];
+    }
+  }
+  return NULL;
+}
+
+/**
+ * @brief Pin prefix, run as pin [-c cpus] [-m nodes] command... Runs the rest
+ *        of the line with every process it launches scheduled only on the
+ *        given CPUs and allocating memory only from the given NUMA nodes, each
+ *        a list such as 0-3,8. Built-ins which are also programs run as the
+ *        programs, so that they can be placed.
+ *
+ * @param cmd command line, whose first word is pin
+ * @return int - 1 if the pinned command was exit, otherwise 0
+ */
+int pinCommand(Command *cmd)
+{
+  Placement place;
+  if (!parsePlacement(&cmd->stages[0], &place))
+  {
+    lastProcessStatus = 2;
+    return 0;
+  }
+
+  // a nested pin replaces the placement for the rest of the line only
+  const Placement *outer = placement;
+  placement = &place;
+  int result = mapArguments(cmd);
+  placement = outer;
+  return result;
+}
+
+/**
+ * @brief Parses the options of the pin prefix at the start of a stage,
+ *        removing them and pin itself from its arguments.
+ *
+ * @param stage stage whose first word is pin
+ * @param place set to the placement given by the options
+ * @return bool - false, after printing an error, if the options are invalid
+ */
+bool parsePlacement(Stage *stage, Placement *place)
+{
+  memset(place, 0, sizeof(*place));
+  int i = 1;
+  for (; stage->argv[i] && stage->argv[i][0] == '-'; i += 2)
+  {
+    bool cpus = strcmp(stage->argv[i], "-c") == 0;
+    if ((!cpus && strcmp(stage->argv[i], "-m") != 0) || !stage->argv[i + 1])
+    {
+      break;
+    }
+    if (!parseNumberList(stage->argv[i + 1], cpus ? place->cpus : place->nodes))
+    {
+      fprintf(stderr, "pin: %s: invalid %s list\n", stage->argv[i + 1], cpus ? "CPU" : "node");
+      return false;
+    }
+    place->pinCpus = place->pinCpus || cpus;
+    place->bindNodes = place->bindNodes || !cpus;
+  }
+  if (!stage->argv[i] || stage->argv[i][0] == '-')
+  {
+    fprintf(stderr, "usage: pin [-c cpus] [-m nodes] command...\n");
+    return false;
+  }
+  stage->argv += i;
+  stage->argc -= i;
+  return true;
+}
+
+/**
+ * @brief Parses a list of numbers and ranges such as 0-3,8 into a bitmask of
+ *        PLACEMENT_BITS bits, adding to the bits already set.
+ *
+ * @param list text of the list
+ * @param mask bitmask receiving a bit for every number listed
+ * @return bool - whether the list was valid
+ */
+bool parseNumberList(const char *list, unsigned long *mask)
+{
+  const int bits = 8 * sizeof(unsigned long);
+  while (true)
+  {
+    char *end;
+    if (!isdigit((unsigned char)*list))
+    {
+      return false;
+    }
+    unsigned long first = strtoul(list, &end, 10);
+    unsigned long last = first;
+    if (*end == '-')
+    {
+      list = end + 1;
+      if (!isdigit((unsigned char)*list))
+      {
+        return false;
+      }
+      last = strtoul(list, &end, 10);
+    }
+    if (last < first || last >= PLACEMENT_BITS)
+    {
+      return false;
+    }
+    for (unsigned long n = first; n <= last; n++)
+    {
+      mask[n / bits] |= 1ul << (n % bits);
+    }
+    if (!*end)
+    {
+      return true;
+    }
+    if (*end != ',')
+    {
+      return false;
+    }
+    list = end + 1;
+  }
+}
+
+/**
+ * @brief Runs within a forked child to apply the placement of the command
+ *        being run by pin, before executing the program. Exits the child if the
+ *        kernel rejects the placement, without flushing the stdio buffers
+ *        shared with small shell.
+ *
+ * @param place placement to apply
+ */
+void applyPlacement(const Placement *place)
+{
+  // an affinity mask is the same bitmask a cpu_set_t holds
+  if (place->pinCpus && sched_setaffinity(0, sizeof(place->cpus), (const cpu_set_t *)place->cpus) == -1)
+  {
+    perror("Error pinning to CPUs");
+    _exit(1);
+  }
+  if (place->bindNodes && syscall(SYS_set_mempolicy, MPOL_BIND, place->nodes, PLACEMENT_BITS + 1) == -1)
+  {
+    perror("Error binding memory to nodes");
+    _exit(1);
+  }
+}
+
+//=============================================================================
+// Control groups
+//=============================================================================
+
+/**
+ * @brief Creates the session cgroup, a child of small shell's own cgroup v2
+ *        group, which holds a cgroup per background job. The controllers the
+ *        session is given are enabled for its jobs, so that each can be
+ *        limited on its own as well as all together.
+ *
+ * @return bool - false, after printing an error, if it couldn't be created
+ */
+bool startCgroupSession()
+{
+  // find where the cgroup v2 hierarchy is mounted, and small shell's group in
+  // it, reading whole lines so that neither path is cut short
+  char *mount = NULL;
+  char *group = NULL;
+  char *line = NULL;
+  size_t capacity = 0;
+  FILE *mounts = fopen("/proc/self/mountinfo", "re");
+  while (mounts && getline(&line, &capacity, mounts) != -1)
+  {
+    // the mount point is the fifth field
+    char *type = strstr(line, " - ");
+    char *point = line;
+    for (int field = 0; field < 4 && point; field++)
+    {
+      point = strchr(point, ' ');
+      point = point ? point + 1 : NULL;
+    }
+    if (type && point && strncmp(type + 3, "cgroup2 ", 8) == 0)
+    {
+      free(mount);
+      mount = strndup(point, strcspn(point, " "));
+    }
+  }
+  FILE *groups = fopen("/proc/self/cgroup", "re");
+  while (groups && getline(&line, &capacity, groups) != -1)
+  {
+    if (strncmp(line, "0::", 3) == 0)
+    {
+      line[strcspn(line, "\n")] = '\0';
+      free(group);
+      group = strdup(strcmp(line + 3, "/") == 0 ? "" : line + 3);
+    }
+  }
+  free(line);
+  if (mounts)
+  {
+    fclose(mounts);
+  }
+  if (groups)
+  {
+    fclose(groups);
+  }
+  if (!mount || !group)
+  {
+    fprintf(stderr, mount ? "set: cgroups: small shell is in no cgroup v2 group\n"
+                          : "set: cgroups: no cgroup v2 hierarchy is mounted\n");
+    free(mount);
+    free(group);
+    return false;
+  }
+
+  char *path;
+  if (asprintf(&path, "%s%s/smallsh.%s", mount, group, shellPid) == -1)
+  {
+    perror("Error allocating cgroup path");
+    exit(1);
+  }
+  free(mount);
+  free(group);
+  cgroupSession.fd = -1;
+  if (mkdir(path, 0755) == -1 || (cgroupSession.fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1)
+  {
+    fprintf(stderr, "set: cgroups: %s: %s\n", path, strerror(errno));
+    rmdir(path);
+    free(path);
+    return false;
+  }
+  cgroupSession.path = path;
+
+  // the session holds no processes itself, so it may pass on its controllers
+  char controllers[256];
+  if (readCgroupFile(cgroupSession.fd, "cgroup.controllers", controllers, sizeof(controllers)))
+  {
+    for (char *name = strtok(controllers, " \n"); name; name = strtok(NULL, " \n"))
+    {
+      char enable[64];
+      snprintf(enable, sizeof(enable), "+%s", name);
+      writeCgroupFile(cgroupSession.fd, "cgroup.subtree_control", enable);
+    }
+  }
+  return true;
+}
+
+/**
+ * @brief Kills every process in the session cgroup at once with cgroup.kill,
+ *        rather than signalling each job, then removes the session once its
+ *        processes have exited.
+ */
+void stopCgroupSession()
+{
+  if (cgroupSession.fd == -1)
+  {
+    return;
+  }
+  if (!writeCgroupFile(cgroupSession.fd, "cgroup.kill", "1"))
+  {
+    // kernels before 5.14 have no cgroup.kill
+    for (int i = jobTable.liveList; i != -1; i = jobTable.jobs[i].next)
+    {
+      killJob(&jobTable.jobs[i]);
+    }
+  }
+
+  // cgroup.events reports populated 0 once the last process has exited
+  int events = openat(cgroupSession.fd, "cgroup.events", O_RDONLY | O_CLOEXEC);
+  for (int i = 0; events != -1 && i < 10; i++)
+  {
+    char text[128];
+    ssize_t length = pread(events, text, sizeof(text) - 1, 0);
+    text[length > 0 ? length : 0] = '\0';
+    if (!strstr(text, "populated 1"))
+    {
+      break;
+    }
+    struct pollfd event = {events, POLLPRI, 0};
+    poll(&event, 1, 100);
+  }
+  if (events != -1)
+  {
+    close(events);
+  }
+
+  // remove the job cgroups, including those kept by processes jobs left behind
+  DIR *dir = fdopendir(dup(cgroupSession.fd));
+  struct dirent *entry;
+  while (dir && (entry = readdir(dir)))
+  {
+    if (entry->d_type == DT_DIR && entry->d_name[0] != '.')
+    {
+      unlinkat(cgroupSession.fd, entry->d_name, AT_REMOVEDIR);
+    }
+  }
+  if (dir)
+  {
+    closedir(dir);
+  }
+  close(cgroupSession.fd);
+  rmdir(cgroupSession.path);
+  cgroupSession.fd = -1;
+}
+
+/**
+ * @brief Creates the cgroup of a new background job within the session.
+ *
+ * @param id set to the number naming the cgroup
+ * @return int - directory descriptor of the cgroup, or -1 if it couldn't be created
+ */
+int createJobCgroup(int *id)
+{
+  char name[32];
+  *id = ++cgroupSession.jobs;
+  snprintf(name, sizeof(name), "job%d", *id);
+  if (mkdirat(cgroupSession.fd, name, 0755) == -1)
+  {
+    fprintf(stderr, "Error creating job cgroup: %s\n", strerror(errno));
+    return -1;
+  }
+  int fd = openat(cgroupSession.fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd == -1)
+  {
+    unlinkat(cgroupSession.fd, name, AT_REMOVEDIR);
+  }
+  return fd;
+}
+
+/**
+ * @brief Removes the cgroup of a job, if it has one. A cgroup still holding
+ *        processes left behind by the job can't be removed, and stays until
+ *        the session ends.
+ *
+ * @param job job whose cgroup to remove
+ */
+void removeJobCgroup(Job *job)
+{
+  if (job->cgroupFd == -1)
+  {
+    return;
+  }
+  char name[32];
+  snprintf(name, sizeof(name), "job%d", job->cgroupId);
+  close(job->cgroupFd);
+  unlinkat(cgroupSession.fd, name, AT_REMOVEDIR);
+  job->cgroupFd = -1;
+}
+
+/**
+ * @brief Forks small shell straight into a cgroup with clone3, so that the
+ *        child never runs outside it. Kernels without CLONE_INTO_CGROUP fall
+ *        back to fork, with the child moving itself into the cgroup.
+ *
+ * @param cgroupFd directory descriptor of the cgroup
+ * @return pid_t - as for fork
+ */
+pid_t forkIntoCgroup(int cgroupFd)
+{
+#if CGROUP_CLONE
+  struct clone_args args = {0};
+  args.flags = CLONE_INTO_CGROUP;
+  args.exit_signal = SIGCHLD;
+  args.cgroup = cgroupFd;
+  pid_t cloned = syscall(SYS_clone3, &args, sizeof(args));
+  if (cloned != -1 || (errno != ENOSYS && errno != EINVAL && errno != E2BIG))
+  {
+    return cloned;
+  }
+#endif
+  pid_t pid = fork();
+  if (pid == 0 && !writeCgroupFile(cgroupFd, "cgroup.procs", "0"))
+  {
+    _exit(1);
+  }
+  return pid;
+}
+
+/**
+ * @brief Reads a small file of a cgroup.
+ *
+ * @param fd directory descriptor of the cgroup
+ * @param name name of the file
+ * @param text buffer receiving the NUL terminated contents
+ * @param size size of the buffer
+ * @return bool - whether the file could be read
+ */
+bool readCgroupFile(int fd, const char *name, char *text, size_t size)
+{
+  int file = openat(fd, name, O_RDONLY | O_CLOEXEC);
+  if (file == -1)
+  {
+    return false;
+  }
+  ssize_t length = read(file, text, size - 1);
+  close(file);
+  text[length > 0 ? length : 0] = '\0';
+  return length >= 0;
+}
+
+/**
+ * @brief Writes a value to a file of a cgroup, printing an error on failure.
+ *
+ * @param fd directory descriptor of the cgroup
+ * @param name name of the file
+ * @param value value to write
+ * @return bool - whether the value was written
+ */
+bool writeCgroupFile(int fd, const char *name, const char *value)
+{
+  int file = openat(fd, name, O_WRONLY | O_CLOEXEC);
+  if (file == -1 || write(file, value, strlen(value)) == -1)
+  {
+    fprintf(stderr, "%s: %s\n", name, strerror(errno));
+    if (file != -1)
+    {
+      close(file);
+    }
+    return false;
+  }
+  close(file);
+  return true;
+}
+
+/**
+ * @brief Finds a counter within the contents of a flat keyed cgroup file
+ *        such as cpu.stat.
+ *
+ * @param text contents of the file
+ * @param key name of the counter
+ * @return long long - value of the counter, or -1 if it is missing
+ */
+long long cgroupCounter(const char *text, const char *key)
+{
+  size_t length = strlen(key);
+  for (const char *line = text; *line; line += strcspn(line, "\n") + (line[strcspn(line, "\n")] != '\0'))
+  {
+    if (strncmp(line, key, length) == 0 && line[length] == ' ')
+    {
+      return atoll(line + length + 1);
+    }
+  }
+  return -1;
+}
+
+/**
+ * @brief Cgroup built-in, run as cgroup [%job|pid] [file value]. Shows the
+ *        usage of every process in the session cgroup together, or of a
+ *        single job - CPU time, memory and process count - or writes a value
+ *        to one of its files, such as cpu.max or memory.max, to limit it.
+ *
+ * @param argv arguments of the built-in
+ */
+void cgroupCommand(char **argv)
+{
+  lastProcessStatus = 1;
+  if (cgroupSession.fd == -1)
+  {
+    fprintf(stderr, "cgroup: no session cgroup, see set -o cgroups\n");
+    return;
+  }
+
+  int fd = cgroupSession.fd;
+  int i = 1;
+  if (argv[i] && (argv[i][0] == '%' || isdigit((unsigned char)argv[i][0])))
+  {
+    Job *job = lookupJob(argv[i]);
+    if (!job || job->cgroupFd == -1)
+    {
+      fprintf(stderr, job ? "cgroup: %s: job has no cgroup\n" : "cgroup: %s: no such job\n", argv[i]);
+      return;
+    }
+    fd = job->cgroupFd;
+    i++;
+  }
+
+  if (argv[i])
+  {
+    if (!argv[i + 1] || argv[i + 2] || strchr(argv[i], '/') || !strchr(argv[i], '.'))
+    {
+      fprintf(stderr, "usage: cgroup [%%job|pid] [file value]\n");
+      lastProcessStatus = 2;
+      return;
+    }
+    lastProcessStatus = !writeCgroupFile(fd, argv[i], argv[i + 1]);
+    return;
+  }
+
+  // show whichever counters the cgroup's controllers provide
+  char text[1024];
+  if (fd == cgroupSession.fd)
+  {
+    printf("cgroup\t%s\n", cgroupSession.path);
+  }
+  else
+  {
+    printf("cgroup\t%s/job%d\n", cgroupSession.path, lookupJob(argv[1])->cgroupId);
+  }
+  if (readCgroupFile(fd, "cpu.stat", text, sizeof(text)))
+  {
+    printf("cpu\t%.3fs (user %.3fs, sys %.3fs)\n", cgroupCounter(text, "usage_usec") / 1e6,
+           cgroupCounter(text, "user_usec") / 1e6, cgroupCounter(text, "system_usec") / 1e6);
+  }
+  if (readCgroupFile(fd, "memory.current", text, sizeof(text)))
+  {
+    printf("memory\t%lldK", atoll(text) / 1024);
+    if (readCgroupFile(fd, "memory.peak", text, sizeof(text)))
+    {
+      printf(" (peak %lldK)", atoll(text) / 1024);
+    }
+    printf("\n");
+  }
+  if (readCgroupFile(fd, "pids.current", text, sizeof(text)))
+  {
+    printf("pids\t%lld\n", atoll(text));
+  }
+  flushOutput();
+  lastProcessStatus = 0;
+}
+
+//=============================================================================
+// Coprocesses
+//=============================================================================
+
+/**
+ * @brief Coproc built-in, run as coproc [-n name] command [args...]. Starts a
+ *        long-lived background job with its stdin and stdout connected to
+ *        small shell by a pair of pipes, so that requests sent with cosend and
+ *        replies read with coread cost no fork, and the command's startup is
+ *        paid once. The coprocess is named COPROC unless given a name.
+ *
+ * @param argv arguments of the built-in
+ */
+void startCoprocess(char **argv)
+{
+  lastProcessStatus = 1;
+  const char *name;
+  int i = coprocessOption(argv, &name);
+  if (i == -1 || !argv[i])
+  {
+    fprintf(stderr, "usage: coproc [-n name] command [args...]\n");
+    return;
+  }
+  if (findCoprocess(name))
+  {
+    fprintf(stderr, "coproc: %s: already running\n", name);
+    return;
+  }
+
+  // the job runs in the background, reading from toChild and writing to fromChild
+  Command cmd = {NULL, 0, true, LIST_END};
+  int capacity = 0;
+  Stage *stage = addStage(&cmd, &capacity);
+  for (; argv[i]; i++)
+  {
+    addArgument(stage, argv[i]);
+  }
+  int toChild[2] = {-1, -1}, fromChild[2];
+  if (pipe2(toChild, O_CLOEXEC) == -1 || pipe2(fromChild, O_CLOEXEC) == -1)
+  {
+    perror("Error creating pipe");
+    if (toChild[0] != -1)
+    {
+      close(toChild[0]);
+      close(toChild[1]);
+    }
+    return;
+  }
+  fflush(stdout);
+  bool spawn = !forkOnly && !placement && !commandLimitMask;
+  pid_t pid = spawn ? spawnStage(&cmd, 0, toChild[0], fromChild[1], 0)
+                    : forkStage(&cmd, 0, toChild[0], fromChild[1], 0);
+  close(toChild[0]);
+  close(fromChild[1]);
+  if (pid == -1)
+  {
+    close(toChild[1]);
+    close(fromChild[0]);
+    return;
+  }
+  setpgid(pid, pid);
+
+  // keep small shell's ends clear of the descriptors redirections replace
+  Coprocess coprocess = {strdup(name), pid, fcntl(toChild[1], F_DUPFD_CLOEXEC, REDIRECT_FD_BASE),
+                         fcntl(fromChild[0], F_DUPFD_CLOEXEC, REDIRECT_FD_BASE), NULL, 0, 0, 0};
+  close(toChild[1]);
+  close(fromChild[0]);
+  if (coprocessCount == coprocessCapacity)
+  {
+    coprocessCapacity = coprocessCapacity ? coprocessCapacity * 2 : 4;
+    coprocesses = realloc(coprocesses, coprocessCapacity * sizeof(Coprocess));
+  }
+  if (!coprocess.name || !coprocesses)
+  {
+    perror("Error allocating coprocess");
+    exit(1);
+  }
+  coprocesses[coprocessCount++] = coprocess;
+
+  char *command;
+  if (asprintf(&command, "coproc %s: %s", name, describeCommand(&cmd)) == -1)
+  {
+    perror("Error allocating job");
+    exit(1);
+  }
+  addJob(pid, &pid, 1, command);
+  free(command);
+  lastBackgroundPid = pid;
+  printf("coproc %s pid is %d\n", name, pid);
+  flushOutput();
+  lastProcessStatus = 0;
+}
+
+/**
+ * @brief Cosend built-in, run as cosend [-n name] words... Writes the words,
+ *        joined by spaces, as a single line to the coprocess in one write.
+ *
+ * @param argv arguments of the built-in
+ */
+void sendCoprocess(char **argv)
+{
+  lastProcessStatus = 1;
+  const char *name;
+  int i = coprocessOption(argv, &name);
+  Coprocess *coprocess = i == -1 ? NULL : findCoprocess(name);
+  if (!coprocess)
+  {
+    fprintf(stderr, i == -1 ? "usage: cosend [-n name] words...\n" : "cosend: %s: no such coprocess\n", name);
+    return;
+  }
+
+  Buffer line = {NULL, 0, 0};
+  for (int j = i; argv[j]; j++)
+  {
+    appendBuffer(&line, " ", j > i);
+    appendBuffer(&line, argv[j], strlen(argv[j]));
+  }
+  appendBuffer(&line, "\n", 1);
+
+  // a coprocess which has exited must fail the write rather than kill small shell
+  struct sigaction ignore = {0}, previous;
+  ignore.sa_handler = SIG_IGN;
+  sigaction(SIGPIPE, &ignore, &previous);
+  size_t written = 0;
+  while (written < line.length)
+  {
+    ssize_t count = write(coprocess->input, line.data + written, line.length - written);
+    if (count == -1 && errno != EINTR)
+    {
+      fprintf(stderr, "cosend: %s: %s\n", name, strerror(errno));
+      break;
+    }
+    written += count == -1 ? 0 : count;
+  }
+  sigaction(SIGPIPE, &previous, NULL);
+  lastProcessStatus = written < line.length;
+}
+
+/**
+ * @brief Coread built-in, run as coread [-n name] [-t seconds] [variable].
+ *        Reads the next line written by the coprocess into the variable, or
+ *        REPLY, without its newline. Output is read in large chunks, with
+ *        lines beyond the first kept for the next coread. The status is 1 at
+ *        end of file, when no whole line arrives within the timeout or when
+ *        interrupted by SIGINT.
+ *
+ * @param argv arguments of the built-in
+ */
+void readCoprocess(char **argv)
+{
+  lastProcessStatus = 1;
+  const char *name;
+  int i = coprocessOption(argv, &name);
+  int timeout = -1;
+  if (i != -1 && argv[i] && strcmp(argv[i], "-t") == 0)
+  {
+    timeout = argv[i + 1] ? (int)(atof(argv[i + 1]) * 1000) : -2;
+    i += 2;
+  }
+  const char *variable = i != -1 && argv[i] ? argv[i] : "REPLY";
+  if (i == -1 || timeout < -1 || (argv[i] && argv[i + 1]) || !*variable || strchr(variable, '='))
+  {
+    fprintf(stderr, "usage: coread [-n name] [-t seconds] [variable]\n");
+    return;
+  }
+  Coprocess *coprocess = findCoprocess(name);
+  if (!coprocess)
+  {
+    fprintf(stderr, "coread: %s: no such coprocess\n", name);
+    return;
+  }
+
+  // let SIGINT interrupt the blocking read
+  struct sigaction previous;
+  beginInterruptibleWait(&previous);
+
+  // the timeout covers the whole line, however many reads it takes
+  struct timespec started;
+  clock_gettime(CLOCK_MONOTONIC, &started);
+  char *newline = NULL;
+  bool ended = false;
+  while (!coprocess->pending ||
+         !(newline = memchr(coprocess->pending + coprocess->start, '\n', coprocess->end - coprocess->start)))
+  {
+    // move the partial line to the front, growing the buffer once it is full
+    if (coprocess->start > 0)
+    {
+      memmove(coprocess->pending, coprocess->pending + coprocess->start, coprocess->end - coprocess->start);
+      coprocess->end -= coprocess->start;
+      coprocess->start = 0;
+    }
+    if (coprocess->capacity - coprocess->end < STREAM_BUFFER_SIZE / 4)
+    {
+      coprocess->capacity = coprocess->capacity ? coprocess->capacity * 2 : STREAM_BUFFER_SIZE;
+      coprocess->pending = realloc(coprocess->pending, coprocess->capacity);
+      if (!coprocess->pending)
+      {
+        perror("Error allocating coprocess buffer");
+        exit(1);
+      }
+    }
+
+    struct pollfd ready = {coprocess->output, POLLIN, 0};
+    int remaining = timeout - (int)(elapsedSince(&started) * 1000);
+    int polled = timeout >= 0 ? poll(&ready, 1, remaining > 0 ? remaining : 0) : 1;
+    if (polled == -1 && errno == EINTR && !waitInterrupted)
+    {
+      continue;
+    }
+    if (polled < 1)
+    {
+      break;
+    }
+    ssize_t count = read(coprocess->output, coprocess->pending + coprocess->end, coprocess->capacity - coprocess->end);
+    if (count == -1 && errno == EINTR && !waitInterrupted)
+    {
+      continue;
+    }
+    if (count <= 0)
+    {
+      ended = count == 0;
+      break;
+    }
+    coprocess->end += count;
+  }
+  endInterruptibleWait(&previous);
+
+  // at end of file a final line without a newline is still read
+  if (newline || (ended && coprocess->end > coprocess->start))
+  {
+    char *line = coprocess->pending + coprocess->start;
+    char *lineEnd = newline ? newline : coprocess->pending + coprocess->end;
+    *lineEnd = '\0';
+    setenv(variable, line, 1);
+    envIndex.stale = true;
+    coprocess->start = lineEnd - coprocess->pending + (newline != NULL);
+    lastProcessStatus = newline == NULL;
+    return;
+  }
+  if (waitInterrupted)
+  {
+    printf("\n");
+    fflush(stdout);
+  }
+}
+
+/**
+ * @brief Coclose built-in, run as coclose [name]. Closes the pipes to the
+ *        coprocess, which sees end of file on its stdin, then waits for it to
+ *        exit, setting the status to its exit value.
+ *
+ * @param argv arguments of the built-in
+ */
+void closeCoprocess(char **argv)
+{
+  lastProcessStatus = 1;
+  const char *name = argv[1] ? argv[1] : DEFAULT_COPROCESS;
+  Coprocess *coprocess = findCoprocess(name);
+  if (!coprocess || (argv[1] && argv[2]))
+  {
+    fprintf(stderr, coprocess ? "usage: coclose [name]\n" : "coclose: %s: no such coprocess\n", name);
+    return;
+  }
+  pid_t pid = coprocess->pid;
+  close(coprocess->input);
+  close(coprocess->output);
+  free(coprocess->name);
+  free(coprocess->pending);
+  *coprocess = coprocesses[--coprocessCount];
+
+  // a coprocess which already exited has been reported by the reaper
+  Job *job = findJob(pid);
+  if (job)
+  {
+    struct sigaction previous;
+    beginInterruptibleWait(&previous);
+    int result = waitJob(job, false);
+    endInterruptibleWait(&previous);
+    drainNotifications();
+    lastProcessStatus = result == -1 ? 1 : result;
+    return;
+  }
+  lastProcessStatus = 0;
+}
+
+/**
+ * @brief Parses the -n name option shared by the coprocess built-ins.
+ *
+ * @param argv arguments of the built-in
+ * @param name set to the name given, or COPROC
+ * @return int - index of the first argument after the option, or -1 if the
+ *         option has no name
+ */
+int coprocessOption(char **argv, const char **name)
+{
+  *name = DEFAULT_COPROCESS;
+  if (!argv[1] || strcmp(argv[1], "-n") != 0)
+  {
+    return 1;
+  }
+  if (!argv[2])
+  {
+    return -1;
+  }
+  *name = argv[2];
+  return 3;
+}
+
+/**
+ * @brief Finds a running coprocess by name.
+ *
+ * @param name name of the coprocess
+ * @return Coprocess* - the coprocess, or NULL if there is none by that name
+ */
+Coprocess *findCoprocess(const char *name)
+{
+  for (int i = 0; i < coprocessCount; i++)
+  {
+    if (strcmp(coprocesses[i].name, name) == 0)
+    {
+      return &coprocesses[i];
+    }
+  }
+  return NULL;
+}
+
+//=============================================================================
+// Tracing
+//=============================================================================
+
+/**
+ * @brief Turns on trace mode, appending a JSON line to the trace file for
+ *        every timed stage and collecting a latency histogram per stage.
+ *
+ * @param path trace file
+ */
+void startTrace(const char *path)
+{
+  traceFile = fopen(path, "ae");
+  if (!traceFile)
+  {
+    perror(path);
+    lastProcessStatus = 1;
+    return;
+  }
+  setvbuf(traceFile, NULL, _IOFBF, STREAM_BUFFER_SIZE);
+  clock_gettime(CLOCK_MONOTONIC, &traceEpoch);
+  memset(traceHistogram, 0, sizeof(traceHistogram));
+  tracing = true;
+}
+
+/**
+ * @brief Turns off trace mode, closing the trace file and printing the count,
+ *        p50 and p99 latency of each stage to stderr. Percentiles are the upper
+ *        bound of the log2 bucket they fall in.
+ */
+void stopTrace()
+{
+  if (!tracing)
+  {
+    return;
+  }
+  tracing = false;
+  fclose(traceFile);
+
+  for (int stage = 0; stage < TRACE_STAGES; stage++)
+  {
+    uint64_t count = 0;
+    for (int i = 0; i < TRACE_BUCKETS; i++)
+    {
+      count += traceHistogram[stage][i];
+    }
+    if (count == 0)
+    {
+      continue;
+    }
+
+    // walk the buckets until half and 99% of the samples have been passed
+    double p50 = 0, p99 = 0;
+    uint64_t seen = 0;
+    for (int i = 0; i < TRACE_BUCKETS && !p99; i++)
+    {
+      seen += traceHistogram[stage][i];
+      p50 = !p50 && seen * 2 >= count ? (double)(2ull << i) : p50;
+      p99 = seen * 100 >= count * 99 ? (double)(2ull << i) : 0;
+    }
+    fprintf(stderr, "trace: %-5s n=%-8llu p50<=%.1fus p99<=%.1fus\n", TRACE_NAMES[stage],
+            (unsigned long long)count, p50 / 1e3, p99 / 1e3);
+  }
+}
+
+/**
+ * @brief Marks the start of a timed stage. Does nothing unless tracing.
+ *
+ * @param mark time to fill in
+ */
+void traceMark(struct timespec *mark)
+{
+  if (tracing)
+  {
+    clock_gettime(CLOCK_MONOTONIC, mark);
+  }
+}
+
+/**
+ * @brief Records a stage which began at mark, then moves mark to now so the
+ *        next stage starts where this one ended. Does nothing unless tracing.
+ *
+ * @param stage stage which has just finished
+ * @param mark time the stage began, updated to now
+ */
+void traceStage(TraceStage stage, struct timespec *mark)
+{
+  if (!tracing)
+  {
+    return;
+  }
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  int64_t start = (mark->tv_sec - traceEpoch.tv_sec) * 1000000000ll + (mark->tv_nsec - traceEpoch.tv_nsec);
+  int64_t ns = (now.tv_sec - mark->tv_sec) * 1000000000ll + (now.tv_nsec - mark->tv_nsec);
+  *mark = now;
+
+  fprintf(traceFile, "{\"stage\":\"%s\",\"start\":%lld,\"ns\":%lld}\n", TRACE_NAMES[stage], (long long)start,
+          (long long)ns);
+  int bucket = ns > 1 ? 63 - __builtin_clzll(ns) : 0;
+  traceHistogram[stage][bucket]++;
+}
+
+//=============================================================================
+// Child tracking
+//=============================================================================
+
+/**
+ * @brief Probes the kernel for pidfd support by opening a pidfd for small
+ *        shell itself. When interactive, creates the epoll instance the prompt
+ *        waits on - input, plus either the pidfd of every background process
+ *        or, on kernels without pidfds, the SIGCHLD self-pipe.
+ */
+void initChildTracking()
+{
+#if PIDFD_TRACKING
+  int pidfd = syscall(SYS_pidfd_open, getpid(), 0);
+  if (pidfd != -1)
+  {
+    pidfdSupported = true;
+    close(pidfd);
+  }
+#endif
+
+  if (!interactive)
+  {
+    return;
+  }
+  eventFd = epoll_create1(EPOLL_CLOEXEC);
+  if (eventFd == -1)
+  {
+    return;
+  }
+
+  // input is tagged 0 and the self-pipe -1, pidfds are tagged with their pid
+  struct epoll_event event = {EPOLLIN, {.u64 = 0}};
+  epoll_ctl(eventFd, EPOLL_CTL_ADD, fileno(inputStream), &event);
+  if (!pidfdSupported)
+  {
+    event.data.u64 = (uint64_t)-1;
+    epoll_ctl(eventFd, EPOLL_CTL_ADD, childPipe[0], &event);
+  }
+}
+
+/**
+ * @brief Opens a pidfd for a background process and adds it to the epoll
+ *        instance. The process is an unreaped child, so its pid can't have
+ *        been recycled before the pidfd pins it.
+ *
+ * @param pid pid of the process
+ * @return int - the pidfd, or -1 without pidfd support
+ */
+int openPidfd(pid_t pid)
+{
+  int pidfd = -1;
+#if PIDFD_TRACKING
+  if (pidfdSupported)
+  {
+    pidfd = syscall(SYS_pidfd_open, pid, 0);
+  }
+#endif
+  if (pidfd != -1 && eventFd != -1)
+  {
+    struct epoll_event event = {EPOLLIN, {.u64 = (uint64_t)pid}};
+    epoll_ctl(eventFd, EPOLL_CTL_ADD, pidfd, &event);
+  }
+  return pidfd;
+}
+
+/**
+ * @brief Blocks until a line of input is ready, reaping background processes
+ *        as soon as their pidfd (or the self-pipe) reports they have exited.
+ *        Finished jobs are reported in one batch and the prompt redrawn.
+ *
+ * @return bool - true when input is ready, false if interrupted by a signal
+ */
+bool waitForInput()
+{
+  if (eventFd == -1)
+  {
+    return true;
+  }
+  while (true)
+  {
+    struct epoll_event events[16];
+    int ready = epoll_wait(eventFd, events, 16, -1);
+    if (ready == -1)
+    {
+      return errno != EINTR;
+    }
+
+    bool input = false;
+    for (int i = 0; i < ready; i++)
+    {
+      pid_t pid = (pid_t)events[i].data.u64;
+      int status;
+      struct rusage rusage;
+      if (events[i].data.u64 == 0)
+      {
+        input = true;
+      }
+      else if (pid == -1)
+      {
+        checkProcessStatus();
+      }
+      else if (wait4(pid, &status, WNOHANG, &rusage) == pid)
+      {
+        reapProcess(pid, status, &rusage);
+      }
+    }
+
+    // report finished jobs on lines of their own, then draw the prompt again
+    if (notifications.written != notifications.queued)
+    {
+      printf("\n");
+      drainNotifications();
+      if (editor.active)
+      {
+        redrawLine();
+      }
+      else
+      {
+        printf("%s", PROMPT);
+        fflush(stdout);
+      }
+    }
+    if (input)
+    {
+      return true;
+    }
+  }
+}
+
+/**
+ * @brief Sends SIGKILL to every process of a job. With pidfds each process is
+ *        signalled through its pidfd, so a recycled pid can never be hit. The
+ *        process group is also killed to catch any of their descendants - the
+ *        job's unreaped processes keep its pgid from being reused.
+ *
+ * @param job job to kill
+ */
+void killJob(Job *job)
+{
+  for (int i = 0; i < job->processCount; i++)
+  {
+#if PIDFD_TRACKING
+    if (job->processes[i].pidfd != -1)
+    {
+      syscall(SYS_pidfd_send_signal, job->processes[i].pidfd, SIGKILL, NULL, 0);
+    }
+#endif
+  }
+  kill(-job->pgid, SIGKILL);
+}
+
+//=============================================================================
+// Environment index
+//=============================================================================
+
+/**
+ * @brief Looks up the value of an environment variable in the environment
+ *        snapshot, rebuilding the snapshot first if it is stale.
+ *
+ * @param name start of the variable name, not necessarily NUL terminated
+ * @param length length of the variable name
+ * @return const char* - value of the variable, or NULL if it is unset
+ */
+const char *lookupVariable(const char *name, size_t length)
+{
+  if (envIndex.stale)
+  {
+    buildEnvIndex();
+  }
+
+  unsigned mask = (1u << envIndex.bits) - 1;
+  for (unsigned i = envHash(name, length) & mask;; i = (i + 1) & mask)
+  {
+    EnvEntry *entry = &envIndex.entries[i];
+    if (!entry->name)
+    {
+      return NULL;
+    }
+    if (entry->nameLength == length && memcmp(entry->name, name, length) == 0)
+    {
+      return entry->value;
+    }
+  }
+}
+
+/**
+ * @brief Rebuilds the environment snapshot from environ, sizing the table to
+ *        at most half full. Where a name appears more than once, the first
+ *        occurrence wins, as with getenv.
+ */
+void buildEnvIndex()
+{
+  extern char **environ;
+
+  int count = 0;
+  while (environ[count])
+  {
+    count++;
+  }
+  int bits = 4;
+  while ((1 << bits) < count * 2)
+  {
+    bits++;
+  }
+
+  free(envIndex.entries);
+  envIndex.entries = calloc((size_t)1 << bits, sizeof(EnvEntry));
+  if (!envIndex.entries)
+  {
+    perror("Error allocating environment index");
+    exit(1);
+  }
+  envIndex.bits = bits;
+  envIndex.stale = false;
+
+  unsigned mask = (1u << bits) - 1;
+  for (int i = 0; i < count; i++)
+  {
+    const char *equals = strchr(environ[i], '=');
+    if (!equals)
+    {
+      continue;
+    }
+    size_t length = equals - environ[i];
+
+    unsigned j = envHash(environ[i], length) & mask;
+    while (envIndex.entries[j].name &&
+           !(envIndex.entries[j].nameLength == length &&
+             memcmp(envIndex.entries[j].name, environ[i], length) == 0))
+    {
+      j = (j + 1) & mask;
+    }
+    if (!envIndex.entries[j].name)
+    {
+      envIndex.entries[j] = (EnvEntry){environ[i], length, equals + 1};
+    }
+  }
+}
+
+/**
+ * @brief FNV-1a hash of a variable name.
+ *
+ * @param name start of the variable name
+ * @param length length of the variable name
+ * @return unsigned - hash of the name
+ */
+unsigned envHash(const char *name, size_t length)
+{
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < length; i++)
+  {
+    hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+  }
+  return hash;
+}
+
+//=============================================================================
+// Server
+//=============================================================================
+
+/**
+ * @brief Serves command lines from clients of a Unix socket, run as
+ *        smallsh --serve path. Every connection carries a stream of lines,
+ *        each a single pipeline, which are launched as background jobs as
+ *        soon as they arrive, through the same parser, PATH cache, spawn path
+ *        and job table as at the prompt. As each job finishes, a ServeRecord
+ *        with its exit status and resource usage is sent back over the
+ *        connection it came from. A client shuts down its side of the
+ *        connection once it has sent its last line, and the server closes
+ *        the connection after the last record. Closing the connection instead
+ *        kills the client's jobs. One epoll loop multiplexes the listening
+ *        socket, every connection and the SIGCHLD self-pipe. Never returns
+ *        unless the socket can't be set up.
+ *
+ * @param path path to bind the socket to
+ * @return int - exit value of small shell
+ */
+int serveConnections(const char *path)
+{
+  // every job holds pidfds and every client a socket, so allow as many as permitted
+  struct rlimit files;
+  if (getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur < files.rlim_max)
+  {
+    files.rlim_cur = files.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &files);
+  }
+
+  struct sockaddr_un address = {0};
+  address.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(address.sun_path))
+  {
+    fprintf(stderr, "smallsh: %s: socket path too long\n", path);
+    return 1;
+  }
+  strcpy(address.sun_path, path);
+
+  // a socket left behind by an earlier server is replaced, anything else is not
+  struct stat existing;
+  if (lstat(path, &existing) == 0 && S_ISSOCK(existing.st_mode))
+  {
+    unlink(path);
+  }
+  int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  serverFd = epoll_create1(EPOLL_CLOEXEC);
+  if (listener == -1 || serverFd == -1 || bind(listener, (struct sockaddr *)&address, sizeof(address)) == -1 ||
+      listen(listener, SOMAXCONN) == -1)
+  {
+    fprintf(stderr, "smallsh: %s: %s\n", path, strerror(errno));
+    return 1;
+  }
+  struct epoll_event event = {EPOLLIN, {.u64 = SERVE_LISTENER}};
+  epoll_ctl(serverFd, EPOLL_CTL_ADD, listener, &event);
+  event.data.u64 = SERVE_CHILDREN;
+  epoll_ctl(serverFd, EPOLL_CTL_ADD, childPipe[0], &event);
+
+  struct epoll_event events[SERVE_EVENTS];
+  while (true)
+  {
+    int count = epoll_wait(serverFd, events, SERVE_EVENTS, -1);
+    for (int i = 0; i < count; i++)
+    {
+      uint64_t tag = events[i].data.u64;
+      if (tag == SERVE_LISTENER)
+      {
+        int fd;
+        while ((fd = accept4(listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1)
+        {
+          addClient(fd);
+        }
+      }
+      else if (tag == SERVE_CHILDREN)
+      {
+        drainChildPipe();
+        reapChildren();
+      }
+      else
+      {
+        int slot = tag - SERVE_CLIENTS;
+        if (events[i].events & EPOLLOUT)
+        {
+          flushClient(slot);
+        }
+        // a client which closed its connection can't receive its records
+        if (clients[slot].fd != -1 && events[i].events & (EPOLLHUP | EPOLLERR))
+        {
+          dropClient(slot);
+        }
+        else if (clients[slot].fd != -1 && events[i].events & EPOLLIN)
+        {
+          readClient(slot);
+        }
+      }
+    }
+  }
+}
+
+/**
+ * @brief Adds a newly accepted connection to the clients, reusing a free slot
+ *        if there is one, and waits for it to send lines.
+ *
+ * @param fd socket of the connection
+ */
+void addClient(int fd)
+{
+  int slot = 0;
+  while (slot < clientCapacity && clients[slot].active)
+  {
+    slot++;
+  }
+  if (slot == clientCapacity)
+  {
+    clientCapacity = clientCapacity ? clientCapacity * 2 : 16;
+    clients = realloc(clients, clientCapacity * sizeof(Client));
+    if (!clients)
+    {
+      perror("Error allocating clients");
+      exit(1);
+    }
+    for (int i = slot; i < clientCapacity; i++)
+    {
+      clients[i].active = false;
+    }
+  }
+  clients[slot] = (Client){fd, true, true, false, 0, 0, NULL, 0, 0, NULL, 0, 0};
+  struct epoll_event event = {EPOLLIN, {.u64 = SERVE_CLIENTS + slot}};
+  epoll_ctl(serverFd, EPOLL_CTL_ADD, fd, &event);
+}
+
+/**
+ * @brief Reads everything a client has sent, launching each complete line.
+ *        At end of file a final line without a newline is launched too, and
+ *        the connection is closed once the records of its jobs have been
+ *        sent.
+ *
+ * @param slot slot of the client
+ */
+void readClient(int slot)
+{
+  while (clients[slot].reading)
+  {
+    Client *client = &clients[slot];
+    if (client->inputCapacity - client->inputLength < STREAM_BUFFER_SIZE / 4)
+    {
+      client->inputCapacity = client->inputCapacity ? client->inputCapacity * 2 : STREAM_BUFFER_SIZE;
+      client->input = realloc(client->input, client->inputCapacity);
+      if (!client->input)
+      {
+        perror("Error allocating client input");
+        exit(1);
+      }
+    }
+    ssize_t count = read(client->fd, client->input + client->inputLength, client->inputCapacity - client->inputLength - 1);
+    if (count == -1 && errno == EINTR)
+    {
+      continue;
+    }
+    if (count == -1 && errno == EAGAIN)
+    {
+      return;
+    }
+    if (count == -1)
+    {
+      dropClient(slot);
+      return;
+    }
+    bool ended = count == 0;
+    if (ended && client->inputLength > 0)
+    {
+      client->input[client->inputLength++] = '\n';
+    }
+    client->inputLength += count;
+
+    // launch each complete line, keeping a partial one for the next read
+    char *line = client->input;
+    char *end = client->input + client->inputLength;
+    char *newline;
+    while (client->fd != -1 && (newline = memchr(line, '\n', end - line)))
+    {
+      *newline = '\0';
+      serveLine(slot, line);
+      line = newline + 1;
+    }
+    if (client->fd == -1)
+    {
+      return;
+    }
+    client->inputLength = end - line;
+    memmove(client->input, line, client->inputLength);
+    client->reading = !ended;
+  }
+
+  // a socket at end of file stays readable, so stop waiting for input
+  watchClient(slot);
+  finishClient(slot);
+}
+
+/**
+ * @brief Launches a line sent by a client as a background job. Lines which
+ *        can't be launched - parse errors, lists, built-ins which would change
+ *        small shell itself, and programs which fail to start or run into a
+ *        descriptor or process limit - are answered straight away with a
+ *        record without a pid, and the server carries on. Blank lines and comments
+ *        are skipped, without a record.
+ *
+ * @param slot slot of the client
+ * @param line text of the line
+ */
+void serveLine(int slot, const char *line)
+{
+  uint32_t number = ++clients[slot].lines;
+  const char *first = line + strspn(line, BLANKS);
+  if (!*first || strncmp(first, COMMENT, 1) == 0)
+  {
+    return;
+  }
+
+  resetArena(&commandArena);
+  Command cmd;
+  Placement place;
+  int status = 2;
+  bool parsed = parseLine(&line, &cmd) != -1 && cmd.stages[0].argv[0];
+  bool pinned = parsed && strcmp(cmd.stages[0].argv[0], PIN) == 0;
+  if (!parsed)
+  {
+    status = 1;
+  }
+  else if (cmd.next != LIST_END)
+  {
+    fprintf(stderr, "smallsh: serve: one pipeline per line\n");
+  }
+  else if (!pinned || parsePlacement(&cmd.stages[0], &place))
+  {
+    const Builtin *builtin = findBuiltin(cmd.stages[0].argv[0]);
+    if (builtin && !builtin->external)
+    {
+      fprintf(stderr, "smallsh: serve: %s: built-in not available\n", builtin->name);
+    }
+    else
+    {
+      // the job is tagged with the client by executeProgram as it is added
+      cmd.background = true;
+      placement = pinned ? &place : NULL;
+      launchClient = slot;
+      launchLine = number;
+      bool launched = executeProgram(&cmd);
+      placement = NULL;
+      launchClient = -1;
+      if (launched)
+      {
+        clients[slot].running++;
+        return;
+      }
+      status = lastProcessStatus;
+    }
+  }
+  serveRecord(slot, number, 0, status, &(Usage){0});
+}
+
+/**
+ * @brief Sends the record of a job, or of a line which couldn't be launched,
+ *        to the client it came from. Records for a client which has gone away
+ *        are dropped.
+ *
+ * @param slot slot of the client
+ * @param line line of the connection the command was read from
+ * @param pgid process group of the finished job, or 0 if it wasn't launched
+ * @param status exit code of the job
+ * @param usage resources used by the job
+ */
+void serveRecord(int slot, uint32_t line, pid_t pgid, int status, const Usage *usage)
+{
+  Client *client = &clients[slot];
+  client->running -= pgid != 0;
+  if (client->fd == -1)
+  {
+    finishClient(slot);
+    return;
+  }
+
+  ServeRecord record = {sizeof(ServeRecord), line, pgid, status, usage->real * 1e6, usage->user * 1e6,
+                        usage->system * 1e6, usage->maxRss, usage->voluntarySwitches, usage->involuntarySwitches};
+  if (client->outputCapacity - client->outputLength < sizeof(record))
+  {
+    client->outputCapacity = client->outputCapacity ? client->outputCapacity * 2 : 64 * sizeof(record);
+    client->output = realloc(client->output, client->outputCapacity);
+    if (!client->output)
+    {
+      perror("Error allocating client output");
+      exit(1);
+    }
+  }
+  memcpy(client->output + client->outputLength, &record, sizeof(record));
+  client->outputLength += sizeof(record);
+  flushClient(slot);
+}
+
+/**
+ * @brief Sends as many pending records to a client as its socket accepts,
+ *        waiting for it to become writable again for the rest.
+ *
+ * @param slot slot of the client
+ */
+void flushClient(int slot)
+{
+  Client *client = &clients[slot];
+  size_t sent = 0;
+  while (sent < client->outputLength)
+  {
+    ssize_t count = send(client->fd, client->output + sent, client->outputLength - sent, MSG_NOSIGNAL);
+    if (count == -1 && errno == EINTR)
+    {
+      continue;
+    }
+    if (count == -1 && errno == EAGAIN)
+    {
+      break;
+    }
+    if (count == -1)
+    {
+      dropClient(slot);
+      return;
+    }
+    sent += count;
+  }
+  client->outputLength -= sent;
+  memmove(client->output, client->output + sent, client->outputLength);
+
+  bool waiting = client->outputLength > 0;
+  if (waiting != client->writing)
+  {
+    client->writing = waiting;
+    watchClient(slot);
+  }
+  finishClient(slot);
+}
+
+/**
+ * @brief Waits for a client's socket to become readable while more lines may
+ *        arrive, and writable while records are pending. A hangup is reported
+ *        either way.
+ *
+ * @param slot slot of the client
+ */
+void watchClient(int slot)
+{
+  Client *client = &clients[slot];
+  struct epoll_event event = {(client->reading ? EPOLLIN : 0) | (client->writing ? EPOLLOUT : 0),
+                              {.u64 = SERVE_CLIENTS + slot}};
+  epoll_ctl(serverFd, EPOLL_CTL_MOD, client->fd, &event);
+}
+
+/**
+ * @brief Closes a client's connection after an error or hangup, killing the
+ *        jobs it launched. Its slot is kept until their records, which are
+ *        dropped, have arrived.
+ *
+ * @param slot slot of the client
+ */
+void dropClient(int slot)
+{
+  Client *client = &clients[slot];
+  close(client->fd);
+  client->fd = -1;
+  client->reading = false;
+  client->outputLength = 0;
+  for (int i = jobTable.liveList; i != -1; i = jobTable.jobs[i].next)
+  {
+    if (jobTable.jobs[i].client == slot)
+    {
+      killJob(&jobTable.jobs[i]);
+    }
+  }
+  finishClient(slot);
+}
+
+/**
+ * @brief Releases a client once it has sent its last line, all of its jobs
+ *        have finished and their records have been sent.
+ *
+ * @param slot slot of the client
+ */
+void finishClient(int slot)
+{
+  Client *client = &clients[slot];
+  if (!client->active || client->reading || client->running > 0 || client->outputLength > 0)
+  {
+    return;
+  }
+  if (client->fd != -1)
+  {
+    close(client->fd);
+    client->fd = -1;
+  }
+  free(client->input);
+  free(client->output);
+  client->active = false;
+}
+
+//=============================================================================
+// Benchmarks
+//=============================================================================
+
+/**
+ * @brief Measures how many foreground `true` commands per second small shell
+ *        launches through the fork and posix_spawn paths. An optional ballast
+ *        of touched memory enlarges the shell's resident set, as when small
+ *        shell is embedded within a larger process.
+ *
+ * @param count number of commands to launch through each path
+ * @param ballast megabytes of memory to allocate and touch beforehand
+ */
+void spawnBenchmark(int count, int ballast)
+{
+  char *memory = NULL;
+  if (ballast > 0)
+  {
+    memory = malloc((size_t)ballast << 20);
+    if (!memory)
+    {
+      perror("Error allocating ballast");
+      exit(1);
+    }
+    memset(memory, 1, (size_t)ballast << 20);
+  }
+
+  for (int path = 0; path < 2; path++)
+  {
+    forkOnly = path == 0;
+
+    struct timespec start;
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < count; i++)
+    {
+      resetArena(&commandArena);
+      Command cmd;
+      const char *line = "true";
+      parseLine(&line, &cmd);
+      executeProgram(&cmd);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("%s: %d spawns in %.3fs, %.0f spawns/sec (ballast %d MB)\n",
+           forkOnly ? "fork" : "posix_spawn", count, seconds, count / seconds, ballast);
+  }
+  forkOnly = false;
+  free(memory);
+}
+
+/**
+ * @brief Measures how long small shell takes from exec to exit, running it
+ *        with an empty script the given number of times, and prints one JSON
+ *        line with the median, 99th percentile and mean latency in
+ *        microseconds and the largest max RSS of any run.
+ *
+ * @param count number of times to start small shell
+ */
+void startupBenchmark(int count)
+{
+  char path[4096];
+  ssize_t length = readlink("/proc/self/exe", path, sizeof(path) - 1);
+  if (length == -1 || count < 1)
+  {
+    fprintf(stderr, "usage: smallsh --startup-bench [count]\n");
+    exit(1);
+  }
+  path[length] = '\0';
+
+  // every run reads end of file at once from /dev/null, and quits
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+  posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+  char *argv[] = {path, NULL};
+
+  long long *latencies = malloc(count * sizeof(long long));
+  if (!latencies)
+  {
+    perror("Error allocating latencies");
+    exit(1);
+  }
+  long long total = 0;
+  long maxrss = 0;
+  for (int i = 0; i < count; i++)
+  {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pid_t pid;
+    int error = posix_spawn(&pid, path, &actions, NULL, argv, environ);
+    if (error)
+    {
+      fprintf(stderr, "Error starting %s: %s\n", path, strerror(error));
+      exit(1);
+    }
+    int status;
+    struct rusage rusage;
+    while (wait4(pid, &status, 0, &rusage) == -1 && errno == EINTR)
+    {
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    latencies[i] = (end.tv_sec - start.tv_sec) * 1000000000LL + (end.tv_nsec - start.tv_nsec);
+    total += latencies[i];
+    maxrss = rusage.ru_maxrss > maxrss ? rusage.ru_maxrss : maxrss;
+  }
+  posix_spawn_file_actions_destroy(&actions);
+
+  qsort(latencies, count, sizeof(long long), compareLatencies);
+  printf("{\"bench\":\"startup\",\"ops\":%d,\"p50_us\":%.1f,\"p99_us\":%.1f,\"mean_us\":%.1f,\"maxrss_kb\":%ld}\n",
+         count, latencies[count / 2] / 1e3, latencies[(count - 1) * 99 / 100] / 1e3, total / 1e3 / count, maxrss);
+  free(latencies);
+}
+
+/**
+ * @brief Orders latencies for qsort, shortest first.
+ *
+ * @param a pointer to a long long
+ * @param b pointer to a long long
+ * @return int - negative, zero or positive as a is shorter, equal or longer
+ */
+int compareLatencies(const void *a, const void *b)
+{
+  long long x = *(const long long *)a;
+  long long y = *(const long long *)b;
+  return (x > y) - (x < y);
+}
+
+//=============================================================================
+// PATH cache
+//=============================================================================
+
+/**
+ * @brief Resolves a command name into the path of an executable. Names
+ *        containing a slash are used as-is. Otherwise the PATH cache is
+ *        consulted, and on a miss each PATH directory is searched in turn and
+ *        the result cached.
+ *
+ * @param name command name
+ * @param cached set to whether the path came from the cache
+ * @return const char* - path to execute, or NULL if the command wasn't found
+ */
+const char *resolveCommand(const char *name, bool *cached)
+{
+  *cached = false;
+  if (strchr(name, '/'))
+  {
+    return name;
+  }
+
+  PathEntry *entry = findCommand(name);
+  if (entry)
+  {
+    *cached = true;
+    entry->hits++;
+    return entry->path;
+  }
+
+  // search each directory of PATH, where an empty directory means the
+  // current directory
+  const char *dirs = lookupVariable("PATH", 4);
+  if (!dirs)
+  {
+    dirs = DEFAULT_PATH;
+  }
+  size_t nameLength = strlen(name);
+  while (true)
+  {
+    const char *dirEnd = strchrnul(dirs, ':');
+    size_t dirLength = dirEnd - dirs;
+
+    char *path = malloc(dirLength + nameLength + 3);
+    if (!path)
+    {
+      perror("Error allocating path");
+      exit(1);
+    }
+    memcpy(path, dirLength ? dirs : ".", dirLength ? dirLength : 1);
+    size_t length = dirLength ? dirLength : 1;
+    path[length++] = '/';
+    memcpy(path + length, name, nameLength + 1);
+
+    struct stat info;
+    if (stat(path, &info) == 0 && S_ISREG(info.st_mode) && access(path, X_OK) == 0)
+    {
+      cacheCommand(strdup(name), path);
+      entry = findCommand(name);
+      entry->hits++;
+      return entry->path;
+    }
+    free(path);
+
+    if (!*dirEnd)
+    {
+      return NULL;
+    }
+    dirs = dirEnd + 1;
+  }
+}
+
+/**
+ * @brief Looks up a command name in the PATH cache.
+ *
+ * @param name command name
+ * @return PathEntry* - the cache entry, or NULL if the name isn't cached
+ */
+PathEntry *findCommand(const char *name)
+{
+  if (pathCache.count == 0)
+  {
+    return NULL;
+  }
+  unsigned mask = (1u << pathCache.bits) - 1;
+  for (unsigned i = envHash(name, strlen(name)) & mask;; i = (i + 1) & mask)
+  {
+    PathEntry *entry = &pathCache.entries[i];
+    if (!entry->name)
+    {
+      return NULL;
+    }
+    if (strcmp(entry->name, name) == 0)
+    {
+      return entry;
+    }
+  }
+}
+
+/**
+ * @brief Adds a command to the PATH cache, taking ownership of both strings.
+ *        The table is doubled whenever it would become more than half full.
+ *
+ * @param name command name
+ * @param path path of the executable found for it
+ */
+void cacheCommand(char *name, char *path)
+{
+  if (!name)
+  {
+    perror("Error allocating path");
+    exit(1);
+  }
+
+  if ((pathCache.count + 1) * 2 > (1 << pathCache.bits) || !pathCache.entries)
+  {
+    int bits = pathCache.bits ? pathCache.bits + 1 : 5;
+    PathEntry *entries = calloc((size_t)1 << bits, sizeof(PathEntry));
+    if (!entries)
+    {
+      perror("Error allocating PATH cache");
+      exit(1);
+    }
+
+    // rehash the existing entries into the larger table
+    PathCache old = pathCache;
+    pathCache = (PathCache){entries, bits, 0};
+    for (int i = 0; old.entries && i < (1 << old.bits); i++)
+    {
+      if (old.entries[i].name)
+      {
+        cacheCommand(old.entries[i].name, old.entries[i].path);
+        findCommand(old.entries[i].name)->hits = old.entries[i].hits;
+      }
+    }
+    free(old.entries);
+  }
+
+  unsigned mask = (1u << pathCache.bits) - 1;
+  unsigned i = envHash(name, strlen(name)) & mask;
+  while (pathCache.entries[i].name)
+  {
+    i = (i + 1) & mask;
+  }
+  pathCache.entries[i] = (PathEntry){name, path, 0};
+  pathCache.count++;
+}
+
+/**
+ * @brief Removes a command from the PATH cache, such as when its cached path
+ *        no longer exists, shifting later entries of the same probe sequence
+ *        back into the hole.
+ *
+ * @param name command name
+ */
+void forgetCommand(const char *name)
+{
+  PathEntry *entry = findCommand(name);
+  if (!entry)
+  {
+    return;
+  }
+  free(entry->name);
+  free(entry->path);
+  pathCache.count--;
+
+  unsigned mask = (1u << pathCache.bits) - 1;
+  unsigned i = entry - pathCache.entries;
+  for (unsigned j = (i + 1) & mask; pathCache.entries[j].name; j = (j + 1) & mask)
+  {
+    PathEntry *next = &pathCache.entries[j];
+    unsigned home = envHash(next->name, strlen(next->name)) & mask;
+    if (((j - home) & mask) >= ((j - i) & mask))
+    {
+      pathCache.entries[i] = *next;
+      i = j;
+    }
+  }
+  pathCache.entries[i] = (PathEntry){NULL, NULL, 0};
+}
+
+/**
+ * @brief Empties the PATH cache, such as when PATH changes.
+ */
+void clearPathCache()
+{
+  for (int i = 0; pathCache.entries && i < (1 << pathCache.bits); i++)
+  {
+    free(pathCache.entries[i].name);
+    free(pathCache.entries[i].path);
+  }
+  free(pathCache.entries);
+  pathCache = (PathCache){NULL, 0, 0};
+}
+
+//=============================================================================
+// Line editor
+//=============================================================================
+
+/**
+ * @brief Reads a line typed at the prompt into inputLine with the terminal in
+ *        raw mode. Every batch of keys read at once is applied to the line,
+ *        and the screen is brought up to date with a single write. Background
+ *        jobs are still reaped while waiting for keys. Ctrl-C discards the
+ *        line, and Ctrl-D on an empty line ends input.
+ *
+ * @return ssize_t - length of the line, or -1 at the end of input, or with
+ *         errno set to EINTR when the line was discarded
+ */
+ssize_t editLine()
+{
+  tcgetattr(STDIN_FILENO, &editor.saved);
+  struct termios raw = editor.saved;
+  raw.c_iflag &= ~(ICRNL | INLCR | IGNCR | IXON);
+  raw.c_lflag &= ~(ICANON | ECHO | ISIG | IEXTEN);
+  raw.c_cc[VMIN] = 1;
+  raw.c_cc[VTIME] = 0;
+  tcsetattr(STDIN_FILENO, TCSADRAIN, &raw);
+
+  // everything but the line itself lives in the command arena
+  int entries = syncHistory();
+  editor = (LineEditor){true, editor.saved, 0, 0, NULL, 0, 0, 0, entries, entries,
+                        NULL, 0, false, EDIT_PENDING, {NULL, 0, 0}};
+  reserveLine(0);
+
+  char keys[256];
+  size_t pending = 0;
+  while (editor.result == EDIT_PENDING)
+  {
+    flushEditor();
+    ssize_t count = -1;
+    if (waitForInput())
+    {
+      count = read(STDIN_FILENO, keys + pending, sizeof(keys) - pending);
+    }
+    if (count == 0 || (count == -1 && errno != EINTR))
+    {
+      editor.result = EDIT_EOF;
+      break;
+    }
+
+    // apply every complete key read, keeping a partial escape sequence
+    size_t used = 0;
+    pending += count > 0 ? count : 0;
+    while (used < pending && editor.result == EDIT_PENDING)
+    {
+      size_t length = editKey(keys + used, pending - used);
+      if (length == 0)
+      {
+        break;
+      }
+      used += length;
+    }
+    pending -= used;
+    memmove(keys, keys + used, pending);
+    if (pending == sizeof(keys))
+    {
+      pending = 0;
+    }
+
+    if (editor.result != EDIT_ACCEPT)
+    {
+      refreshLine();
+    }
+  }
+
+  editor.cursor = editor.length;
+  refreshLine();
+  if (editor.result == EDIT_INTERRUPT)
+  {
+    appendBuffer(&editor.output, "^C", 2);
+  }
+  appendBuffer(&editor.output, "\n", 1);
+  flushEditor();
+  tcsetattr(STDIN_FILENO, TCSADRAIN, &editor.saved);
+  editor.active = false;
+
+  inputLine[editor.length] = '\0';
+  errno = editor.result == EDIT_INTERRUPT ? EINTR : 0;
+  return editor.result == EDIT_ACCEPT ? (ssize_t)editor.length : -1;
+}
+
+/**
+ * @brief Applies the key at the start of a batch of keys read from the
+ *        terminal to the line being edited.
+ *
+ * @param keys keys read and not yet applied
+ * @param count number of bytes of keys
+ * @return size_t - bytes making up the key, or 0 if it is an incomplete
+ *         escape sequence
+ */
+size_t editKey(const char *keys, size_t count)
+{
+  int key = (unsigned char)keys[0];
+  size_t length = 1;
+  bool tab = key == '\t';
+
+  // decode escape sequences for the cursor and editing keys into the
+  // control keys with the same effect
+  if (key == '\x1b')
+  {
+    if (count < 2)
+    {
+      return 0;
+    }
+    length = 2;
+    if (keys[1] == '[' || keys[1] == 'O')
+    {
+      while (length < count && !(keys[length] >= 0x40 && keys[length] <= 0x7e))
+      {
+        length++;
+      }
+      if (length == count)
+      {
+        return 0;
+      }
+      char final = keys[length++];
+      int code = atoi(keys + 2);
+      key = final == 'A' ? CTRL('P') : final == 'B' ? CTRL('N') : final == 'C' ? CTRL('F')
+          : final == 'D' ? CTRL('B') : final == 'H' ? CTRL('A') : final == 'F' ? CTRL('E')
+          : final != '~' ? 0 : code == 1 || code == 7 ? CTRL('A') : code == 4 || code == 8 ? CTRL('E')
+          : code == 3 ? KEY_DELETE : 0;
+    }
+    else
+    {
+      key = 0;
+    }
+  }
+
+  size_t cursor = editor.cursor;
+  switch (key)
+  {
+  case '\r':
+  case '\n':
+    editor.result = EDIT_ACCEPT;
+    break;
+  case CTRL('C'):
+    editor.result = EDIT_INTERRUPT;
+    break;
+  case CTRL('D'):
+    if (editor.length == 0)
+    {
+      editor.result = EDIT_EOF;
+      break;
+    }
+    // fall through - delete the character under the cursor
+  case KEY_DELETE:
+    eraseLine(cursor, nextChar(cursor));
+    break;
+  case '\x7f':
+  case CTRL('H'):
+    eraseLine(previousChar(cursor), cursor);
+    break;
+  case CTRL('A'):
+    editor.cursor = 0;
+    break;
+  case CTRL('E'):
+    editor.cursor = editor.length;
+    break;
+  case CTRL('B'):
+    editor.cursor = previousChar(cursor);
+    break;
+  case CTRL('F'):
+    editor.cursor = nextChar(cursor);
+    break;
+  case CTRL('K'):
+    eraseLine(cursor, editor.length);
+    break;
+  case CTRL('U'):
+    eraseLine(0, cursor);
+    break;
+  case CTRL('W'):
+    while (cursor > 0 && strchr(BLANKS, inputLine[cursor - 1]))
+    {
+      cursor--;
+    }
+    while (cursor > 0 && !strchr(BLANKS, inputLine[cursor - 1]))
+    {
+      cursor--;
+    }
+    eraseLine(cursor, editor.cursor);
+    break;
+  case CTRL('L'):
+    appendBuffer(&editor.output, "\x1b[H\x1b[2J", 7);
+    redrawLine();
+    break;
+  case CTRL('P'):
+  case CTRL('N'):
+    recallHistory(key == CTRL('P') ? -1 : 1);
+    break;
+  case '\t':
+    completeWord(editor.lastKeyTab);
+    break;
+  default:
+    // insert printable characters, including the bytes of UTF-8 sequences
+    if (key >= ' ' && key != '\x1b')
+    {
+      insertLine(keys, 1);
+    }
+  }
+  editor.lastKeyTab = tab;
+  return length;
+}
+
+/**
+ * @brief Ensures inputLine has room for a line of a given length and its
+ *        terminator.
+ *
+ * @param length length of the line
+ */
+void reserveLine(size_t length)
+{
+  if (length + 1 <= inputCapacity)
+  {
+    return;
+  }
+  size_t capacity = inputCapacity ? inputCapacity : 128;
+  while (capacity < length + 1)
+  {
+    capacity *= 2;
+  }
+  char *line = realloc(inputLine, capacity);
+  if (!line)
+  {
+    perror("Error allocating line");
+    exit(1);
+  }
+  inputLine = line;
+  inputCapacity = capacity;
+}
+
+/**
+ * @brief Inserts text into the line being edited at the cursor, moving the
+ *        cursor past it.
+ *
+ * @param text text to insert
+ * @param length length of the text
+ */
+void insertLine(const char *text, size_t length)
+{
+  reserveLine(editor.length + length);
+  memmove(inputLine + editor.cursor + length, inputLine + editor.cursor, editor.length - editor.cursor);
+  memcpy(inputLine + editor.cursor, text, length);
+  editor.length += length;
+  editor.cursor += length;
+}
+
+/**
+ * @brief Removes a range of the line being edited, leaving the cursor at its
+ *        start.
+ *
+ * @param from offset of the first byte removed
+ * @param to offset of the byte following the range
+ */
+void eraseLine(size_t from, size_t to)
+{
+  memmove(inputLine + from, inputLine + to, editor.length - to);
+  editor.length -= to - from;
+  editor.cursor = from;
+}
+
+/**
+ * @brief Replaces the line being edited, placing the cursor at its end.
+ *
+ * @param text new line
+ * @param length length of the new line
+ */
+void replaceLine(const char *text, size_t length)
+{
+  reserveLine(length);
+  memcpy(inputLine, text, length);
+  editor.length = editor.cursor = length;
+}
+
+/**
+ * @brief Finds the start of the character before an offset of the line being
+ *        edited, stepping over whole UTF-8 sequences.
+ *
+ * @param offset offset within the line
+ * @return size_t - offset of the previous character, or 0
+ */
+size_t previousChar(size_t offset)
+{
+  while (offset > 0 && (inputLine[--offset] & 0xc0) == 0x80)
+  {
+  }
+  return offset;
+}
+
+/**
+ * @brief Finds the start of the character after an offset of the line being
+ *        edited, stepping over whole UTF-8 sequences.
+ *
+ * @param offset offset within the line
+ * @return size_t - offset of the next character, or the length of the line
+ */
+size_t nextChar(size_t offset)
+{
+  while (offset < editor.length && (inputLine[++offset] & 0xc0) == 0x80)
+  {
+  }
+  return offset < editor.length ? offset : editor.length;
+}
+
+/**
+ * @brief Counts the columns taken by some text, as characters rather than the
+ *        bytes of their UTF-8 sequences.
+ *
+ * @param text text to measure
+ * @param length length of the text
+ * @return size_t - number of columns
+ */
+size_t textColumns(const char *text, size_t length)
+{
+  size_t columns = 0;
+  for (size_t i = 0; i < length; i++)
+  {
+    columns += ((unsigned char)text[i] & 0xc0) != 0x80;
+  }
+  return columns;
+}
+
+/**
+ * @brief Moves the terminal cursor left or right over part of the line.
+ *
+ * @param text text between the two positions
+ * @param length length of the text
+ * @param right whether to move right over it rather than left
+ */
+void moveCursor(const char *text, size_t length, bool right)
+{
+  size_t columns = textColumns(text, length);
+  if (columns)
+  {
+    char move[32];
+    int moveLength = snprintf(move, sizeof(move), "\x1b[%zu%c", columns, right ? 'C' : 'D');
+    appendBuffer(&editor.output, move, moveLength);
+  }
+}
+
+/**
+ * @brief Queues the escape sequences bringing the screen from the line as
+ *        last drawn to the line being edited. Only the text following the
+ *        first difference is rewritten, so typing at the end of the line
+ *        writes nothing but the typed characters.
+ */
+void refreshLine()
+{
+  size_t same = 0;
+  while (same < editor.shownLength && same < editor.length && editor.shown[same] == inputLine[same])
+  {
+    same++;
+  }
+  while (same > 0 && ((same < editor.length && (inputLine[same] & 0xc0) == 0x80) ||
+                      (same < editor.shownLength && (editor.shown[same] & 0xc0) == 0x80)))
+  {
+    same--;
+  }
+
+  if (same == editor.length && same == editor.shownLength)
+  {
+    // only the cursor has moved
+    if (editor.cursor < editor.shownCursor)
+    {
+      moveCursor(inputLine + editor.cursor, editor.shownCursor - editor.cursor, false);
+    }
+    else
+    {
+      moveCursor(inputLine + editor.shownCursor, editor.cursor - editor.shownCursor, true);
+    }
+  }
+  else
+  {
+    if (same < editor.shownCursor)
+    {
+      moveCursor(editor.shown + same, editor.shownCursor - same, false);
+    }
+    else
+    {
+      moveCursor(editor.shown + editor.shownCursor, same - editor.shownCursor, true);
+    }
+    appendBuffer(&editor.output, inputLine + same, editor.length - same);
+    if (textColumns(editor.shown + same, editor.shownLength - same) >
+        textColumns(inputLine + same, editor.length - same))
+    {
+      appendBuffer(&editor.output, "\x1b[K", 3);
+    }
+    moveCursor(inputLine + editor.cursor, editor.length - editor.cursor, false);
+  }
+
+  if (editor.length > editor.shownCapacity)
+  {
+    editor.shown = reallocate(&commandArena, editor.shown, editor.shownCapacity, editor.length * 2);
+    editor.shownCapacity = editor.length * 2;
+  }
+  memcpy(editor.shown, inputLine, editor.length);
+  editor.shownLength = editor.length;
+  editor.shownCursor = editor.cursor;
+}
+
+/**
+ * @brief Draws the prompt and the line being edited anew, such as below a
+ *        background job's completion message. Does nothing when no line is
+ *        being edited.
+ */
+void redrawLine()
+{
+  if (!editor.active)
+  {
+    return;
+  }
+  fflush(stdout);
+  appendBuffer(&editor.output, PROMPT, strlen(PROMPT));
+  editor.shownLength = editor.shownCursor = 0;
+  refreshLine();
+  flushEditor();
+}
+
+/**
+ * @brief Writes the queued output of the line editor to the terminal.
+ */
+void flushEditor()
+{
+  for (size_t written = 0; written < editor.output.length;)
+  {
+    ssize_t result = write(STDOUT_FILENO, editor.output.data + written, editor.output.length - written);
+    if (result == -1 && errno != EINTR)
+    {
+      break;
+    }
+    written += result > 0 ? result : 0;
+  }
+  editor.output.length = 0;
+}
+
+/**
+ * @brief Replaces the line being edited with an older or newer history
+ *        entry. The line typed before recalling history is kept, and comes
+ *        back after the newest entry.
+ *
+ * @param step -1 for the previous entry, 1 for the next
+ */
+void recallHistory(int step)
+{
+  int recalled = editor.recalled + step;
+  if (recalled < 0 || recalled > editor.entries)
+  {
+    appendBuffer(&editor.output, "\a", 1);
+    return;
+  }
+  if (editor.recalled == editor.entries)
+  {
+    editor.draft = allocate(&commandArena, editor.length + 1);
+    memcpy(editor.draft, inputLine, editor.length);
+    editor.draftLength = editor.length;
+  }
+  editor.recalled = recalled;
+
+  size_t length = editor.draftLength;
+  const char *entry = recalled == editor.entries ? editor.draft : historyEntry(recalled, &length);
+  replaceLine(entry, length);
+}
+
+/**
+ * @brief Compares two completion candidates for qsort.
+ */
+int compareNames(const void *a, const void *b)
+{
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/**
+ * @brief Adds the entries of a directory beginning with a prefix to a list
+ *        of completion candidates, each followed by a / for directories and a
+ *        space otherwise. Hidden entries are only added if the prefix begins
+ *        with a dot.
+ *
+ * @param path directory to read
+ * @param prefix text the entries must begin with
+ * @param length length of the prefix
+ * @param executables whether to add only executable files, as commands
+ * @param names candidates, each NUL terminated
  */
-void parseCommandLine()
+void addDirectoryNames(const char *path, const char *prefix, size_t length, bool executables, Buffer *names)
 {
-  while (shellActive)
+  DIR *dir = opendir(path);
+  if (!dir)
   {
-
-    checkProcessStatus();
-    fflush(stdout);
-    printf(": ");
-
-    // Setup signal handler from SIGTSTP to enter/exit foerground only mode
-    // using a RESTART flag to restart any interrupted system/library calls
-    // adapted from Exploration 5: Signal Handling API
-    struct sigaction SIGTSTP_action = {0};
-    SIGTSTP_action.sa_handler = foregroundOnlyMode;
-    sigfillset(&SIGTSTP_action.sa_mask);
-    SIGTSTP_action.sa_flags = SA_RESTART;
-    sigaction(SIGTSTP, &SIGTSTP_action, NULL);
-
-    // Initialize a command struct and read raw CLI input into it
-    Command cmd;
-    memset(&cmd, 0, sizeof(Command));
-    fgets(cmd.line, MAX_LENGTH, stdin);
-    strtok(cmd.line, "\n");
-
-    // Ignore comments/blank-lines
-    if (strncmp((const char *)cmd.line, COMMENT, 1) == 0)
+    return;
+  }
+  struct dirent *entry;
+  while ((entry = readdir(dir)))
+  {
+    const char *name = entry->d_name;
+    if (strncmp(name, prefix, length) != 0 || (name[0] == '.' && (prefix[0] != '.' || !length)) ||
+        strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
     {
       continue;
     }
 
-    // Check input for expansion characters and expand them into the pid of Small Shell
-    checkVariableExpansion(&cmd);
-
-    // Tokenize raw CLI input into an array of pointers, delineating arguments
-    // by spaces. Pass them to a handler function which determines whether to
-    // execute a built-in or non-built-in function
-    tokenize(&cmd);
-    if (mapArguments(&cmd))
+    struct stat info;
+    bool directory = entry->d_type == DT_DIR;
+    if (entry->d_type == DT_UNKNOWN || entry->d_type == DT_LNK)
     {
-      shellActive = false;
-      exitSmallsh();
+      directory = fstatat(dirfd(dir), name, &info, 0) == 0 && S_ISDIR(info.st_mode);
     }
+    if (executables && (directory || faccessat(dirfd(dir), name, X_OK, 0) != 0))
+    {
+      continue;
+    }
+    appendBuffer(names, name, strlen(name));
+    appendBuffer(names, directory ? "/" : " ", 2);
   }
+  closedir(dir);
 }
 
 /**
- * @brief Checks the status of processes running in the background before aech
- *        iteration of the shell loop. Processes that have exited will have
- *        their exit status printed to the terminal, as well as processes that
- *        have been terminated by signal, along with the signal that terminated
- *        them.
+ * @brief Completes the word before the cursor. The first word of a command
+ *        is completed from the built-ins, the PATH cache and then PATH, and
+ *        any other word from the files of its directory. The word is extended
+ *        by however much all candidates share, and when that is nothing, a
+ *        second Tab lists them.
+ *
+ * @param list whether to list the candidates when the word can't be extended
  */
-void checkProcessStatus()
+void completeWord(bool list)
 {
-  // iterate through the global processes array, reporting the status of child
-  // processes that have exited or been terminated. Adapted from Module 4:
-  // Process API - Monitoring Child Processes
-  for (int i = 0; i < MAX_LENGTH; i++)
+  size_t start = editor.cursor;
+  while (start > 0 && !strchr(" \t|&;<>", inputLine[start - 1]))
   {
-    int status;
-    pid_t pid = processes[i];
-    if (waitpid(pid, &status, WNOHANG) > 0)
+    start--;
+  }
+  size_t before = start;
+  while (before > 0 && strchr(BLANKS, inputLine[before - 1]))
+  {
+    before--;
+  }
+  char *word = allocate(&commandArena, editor.cursor - start + 1);
+  memcpy(word, inputLine + start, editor.cursor - start);
+  word[editor.cursor - start] = '\0';
+
+  // gather every candidate, followed by the character inserted after it
+  Buffer names = {NULL, 0, 0};
+  char *base = strrchr(word, '/');
+  if ((before == 0 || strchr("|&;", inputLine[before - 1])) && !base)
+  {
+    size_t length = strlen(word);
+    for (int i = 0; i < BUILTIN_COUNT; i++)
     {
-      if (WIFEXITED(status))
+      if (strncmp(BUILTINS[i].name, word, length) == 0)
       {
-        printf("Background pid %d is done: exit value %d\n", pid, status);
+        appendBuffer(&names, BUILTINS[i].name, strlen(BUILTINS[i].name));
+        appendBuffer(&names, " ", 2);
       }
-      else if (WIFSIGNALED(status))
+    }
+    for (int i = 0; pathCache.entries && i < (1 << pathCache.bits); i++)
+    {
+      if (pathCache.entries[i].name && strncmp(pathCache.entries[i].name, word, length) == 0)
       {
-        printf("Background pid %d is done: terminated by signal %d\n", pid, WTERMSIG(status));
+        appendBuffer(&names, pathCache.entries[i].name, strlen(pathCache.entries[i].name));
+        appendBuffer(&names, " ", 2);
       }
-      fflush(stdout);
     }
+    const char *dirs = lookupVariable("PATH", 4);
+    for (const char *dir = dirs ? dirs : DEFAULT_PATH;; dir++)
+    {
+      const char *dirEnd = strchrnul(dir, ':');
+      char *path = allocate(&commandArena, dirEnd - dir + 2);
+      memcpy(path, dir, dirEnd - dir);
+      strcpy(path + (dirEnd - dir), dirEnd == dir ? "." : "");
+      addDirectoryNames(path, word, length, true, &names);
+      if (!*dirEnd)
+      {
+        break;
+      }
+      dir = dirEnd;
+    }
+  }
+  else
+  {
+    const char *dir = base ? word : ".";
+    if (base)
+    {
+      *base = '\0';
+      dir = base == word ? "/" : word;
+    }
+    base = base ? base + 1 : word;
+    addDirectoryNames(dir, base, strlen(base), false, &names);
+  }
+  size_t baseLength = strlen(base ? base : word);
+
+  int count = 0;
+  for (size_t i = 0; i < names.length; i += strlen(names.data + i) + 1)
+  {
+    count++;
+  }
+  if (count == 0)
+  {
+    appendBuffer(&editor.output, "\a", 1);
+    return;
+  }
+  char **candidates = allocate(&commandArena, count * sizeof(char *));
+  count = 0;
+  for (size_t i = 0; i < names.length; i += strlen(names.data + i) + 1)
+  {
+    candidates[count++] = names.data + i;
+  }
+  qsort(candidates, count, sizeof(char *), compareNames);
+  int unique = 1;
+  for (int i = 1; i < count; i++)
+  {
+    if (strcmp(candidates[i], candidates[unique - 1]) != 0)
+    {
+      candidates[unique++] = candidates[i];
+    }
+  }
+
+  // sorted, the first and last candidates differ the soonest
+  size_t common = 0;
+  const char *first = candidates[0];
+  const char *last = candidates[unique - 1];
+  while (first[common] && first[common] == last[common])
+  {
+    common++;
+  }
+
+  if (common > baseLength)
+  {
+    for (size_t i = baseLength; i < common; i++)
+    {
+      // the space ending a unique candidate separates it from the next word
+      if (strchr(WORD_DELIMITERS, first[i]) && !(i + 1 == common && unique == 1))
+      {
+        insertLine("\\", 1);
+      }
+      insertLine(first + i, 1);
+    }
+  }
+  else if (list && unique > 1)
+  {
+    appendBuffer(&editor.output, "\n", 1);
+    for (int i = 0; i < unique; i++)
+    {
+      size_t length = strlen(candidates[i]);
+      appendBuffer(&editor.output, candidates[i], length - (candidates[i][length - 1] == ' '));
+      appendBuffer(&editor.output, i + 1 < unique ? "  " : "\n", i + 1 < unique ? 2 : 1);
+    }
+    appendBuffer(&editor.output, PROMPT, strlen(PROMPT));
+    editor.shownLength = editor.shownCursor = 0;
+  }
+  else
+  {
+    appendBuffer(&editor.output, "\a", 1);
   }
 }
 
+//=============================================================================
+// History
+//=============================================================================
+
 /**
- * @brief Scans raw cli input for possible variable expansion. Expansion characters
- *        ($) must be found in groups of two. If so, the array indices corresponding
- *        to the expansion characters are modified to a format string, and inserted
- *        into a buffer using sprintf. Finally, the buffer is copied back into
- *        the command struct's line property.
- *
- * @param cmd - command struct with property line, containing raw cli input from user
+ * @brief Opens the history file named by HISTFILE, or ~/.smallsh_history, for
+ *        appending. The file is not read until history is first looked up, so
+ *        the size of the history has no effect on startup.
  */
-void checkVariableExpansion(Command *cmd)
+void openHistory()
 {
-  pid_t pid = getpid();    // get pid of small shell
-  char buffer[MAX_LENGTH]; // initialize a buffer to hold expanded input
-
-  // zero out buffer to get rid of junk data
-  for (int i = 0; i < MAX_LENGTH; i++)
+  const char *path = getenv(HISTORY_VARIABLE);
+  char *home = NULL;
+  if (!path || !*path)
   {
-    buffer[i] = 0;
+    const char *dir = getenv("HOME");
+    if (!dir || asprintf(&home, "%s/%s", dir, DEFAULT_HISTORY_FILE) == -1)
+    {
+      return;
+    }
+    path = home;
   }
 
-  // iterate through cli input while still reading chars in i and i+1
-  for (int i = 0; cmd->line[i] && cmd->line[i + 1]; i++)
+  history.fd = open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+  if (history.fd == -1)
   {
-    // found a pair of expansion characters ($$) - expand using a format string
-    // and sprintf and copy back into command struct
-    if (cmd->line[i] == EXPAND && cmd->line[i + 1] == EXPAND)
-    {
-      cmd->line[i] = '%';
-      cmd->line[i + 1] = 'd';
-      sprintf(buffer, cmd->line, pid);
-      strcpy(cmd->line, buffer);
-    }
+    perror(path);
   }
+  free(home);
 }
 
 /**
- * @brief Tokenizes raw CLI input and stores individual arguments into an array
- *        of pointers within the command struct. Arguments are separated by
- *        whitespace.
+ * @brief Appends a line to the history file. The entry is written with a
+ *        single write under an exclusive lock, so entries appended at the
+ *        same time by other shells are never interleaved. It is indexed on
+ *        the next lookup, along with anything other shells have appended.
  *
- * @param cmd Command struct containing raw cli input
+ * @param line text of the command
+ * @param length length of the command
  */
-void tokenize(Command *cmd)
+void addHistory(const char *line, size_t length)
 {
-  int i = 0;
-  char *token = strtok(cmd->line, " ");
-  while (token != NULL)
+  if (history.fd == -1)
   {
-    cmd->args[i] = token;
-    token = strtok(NULL, " ");
-    i++;
+    return;
+  }
+  char *entry = allocate(&commandArena, length + 1);
+  memcpy(entry, line, length);
+  entry[length] = '\n';
+
+  flock(history.fd, LOCK_EX);
+  for (size_t written = 0; written <= length;)
+  {
+    ssize_t result = write(history.fd, entry + written, length + 1 - written);
+    if (result == -1 && errno != EINTR)
+    {
+      perror("Error writing history");
+      break;
+    }
+    written += result > 0 ? result : 0;
   }
+  flock(history.fd, LOCK_UN);
 }
 
 /**
- * @brief Maps parsed user input into commands to be executed by small shell.
- *        Null, blank space, or blank lines will lead to a reprompt. CD will
- *        call the change directory function. Exit will simply return 1, which
- *        is handled in the caller function. Finally, any non built-in functions
- *        will be passed to the executeProgram function which handles that case.
+ * @brief Brings the history index up to date with the file. The mapping is
+ *        grown to cover whatever has been appended since the last lookup,
+ *        and only those new bytes are scanned for the start of each entry.
+ *        A partially written last line is left for a later lookup.
  *
- * @param cmd command struct containing parsed input
- * @return int 1 - in case of exit, else 0
+ * @return int - number of entries
  */
-int mapArguments(Command *cmd)
+int syncHistory()
 {
-  // pull the first argument in parsed input to decide what execution path to take
-  char *arg = cmd->args[0];
-
-  // if argument is NULL, or a blank space/line, print a newline and reprompt
-  if (!arg || strcmp(arg, BLANK_SPACE) == 0 || (strcmp(arg, BLANK_LINE) == 0))
+  struct stat info;
+  if (history.fd == -1 || fstat(history.fd, &info) == -1)
   {
-    printf("\n");
-    fflush(stdout);
-    return 0;
+    return history.count;
   }
+  size_t size = info.st_size;
 
-  // return 1 when an exit command is read - caller function handles this case
-  if (strcmp(arg, EXIT_SHELL) == 0)
+  // the file only shrinks if it was rewritten behind our back - start over
+  if (size < history.mapped)
   {
-    return 1;
+    munmap(history.map, history.mapped);
+    free(history.offsets);
+    free(history.sameFirst);
+    history = (History){history.fd, NULL, 0, 0, NULL, NULL, {0}, 0, 0};
+  }
+  if (size == history.mapped)
+  {
+    return history.count;
   }
 
-  if (strcmp(arg, CHANGE_DIR) == 0)
+  char *map = history.map ? mremap(history.map, history.mapped, size, MREMAP_MAYMOVE)
+                          : mmap(NULL, size, PROT_READ, MAP_SHARED, history.fd, 0);
+  if (map == MAP_FAILED)
   {
-    cd(cmd->args[1]);
-    return 0;
+    perror("Error mapping history");
+    return history.count;
   }
+  history.map = map;
+  history.mapped = size;
 
-  if (strcmp(arg, STATUS) == 0)
+  const char *end = map + size;
+  for (const char *line = map + history.indexed; line < end;)
   {
-    status();
-    return 0;
+    const char *newline = memchr(line, '\n', end - line);
+    if (!newline)
+    {
+      break;
+    }
+    if (history.count == history.capacity)
+    {
+      int capacity = history.capacity ? history.capacity * 2 : 1024;
+      size_t *offsets = realloc(history.offsets, capacity * sizeof(size_t));
+      int *sameFirst = offsets ? realloc(history.sameFirst, capacity * sizeof(int)) : NULL;
+      if (!sameFirst)
+      {
+        perror("Error allocating history");
+        exit(1);
+      }
+      history.offsets = offsets;
+      history.sameFirst = sameFirst;
+      history.capacity = capacity;
+    }
+
+    // chain the entry onto the newest entry starting with the same byte
+    unsigned char first = *line;
+    history.offsets[history.count] = line - map;
+    history.sameFirst[history.count] = history.latest[first];
+    history.latest[first] = ++history.count;
+    line = newline + 1;
+    history.indexed = line - map;
   }
-  // if no built-in commands are detected, pass the command struct along to the
-  // non built-in command handler
-  executeProgram(cmd);
-  return 0;
+  return history.count;
 }
 
-//=============================================================================
-// Built-in commands
-//=============================================================================
-
 /**
- * @brief Exits small shell by using the SIGKILL signal on any running background
- *        processess before exiting the parent shell.
+ * @brief Finds the text of a history entry within the mapping.
  *
- *        Reference: stackoverflow.com/questions/6501522/how-to-kill-a-child-process-by-the-parent-process
+ * @param index entry number, counting from 0
+ * @param length set to the length of the entry, excluding its newline
+ * @return const char* - the entry, which is not NUL terminated
  */
-void exitSmallsh()
+const char *historyEntry(int index, size_t *length)
 {
-  for (int i = 0; i < MAX_LENGTH; i++)
-  {
-    // if process is not null
-    processes[i] ? kill(processes[i], SIGKILL) : 0;
-  }
-  exit(0);
+  size_t start = history.offsets[index];
+  size_t end = index + 1 < history.count ? history.offsets[index + 1] : history.indexed;
+  *length = end - start - 1;
+  return history.map + start;
 }
 
 /**
- * @brief Change directory built-in command. Accepts a directory path and attempts
- *        to change directory to that path, if it exists. Otherwise, the function
- *        swaps to the directory specified inside the HOME environment variable.
- * @param path directory to change to
- * @return int - result from attempting to change directory
+ * @brief Finds the newest history entry beginning with a prefix, comparing
+ *        only the entries chained under the prefix's first byte.
+ *
+ * @param prefix text the entry must begin with
+ * @param length length of the prefix, at least 1
+ * @return int - entry number, or -1 if no entry matches
  */
-int cd(char *path)
+int findHistory(const char *prefix, size_t length)
 {
-  if (path == NULL)
+  for (int i = history.latest[(unsigned char)*prefix]; i; i = history.sameFirst[i - 1])
   {
-    path = getenv("HOME");
-  }
-
-  int result = chdir(path);
-  if (result < 0)
-  {
-    perror("Error changing directory");
-    return -1;
+    size_t entryLength;
+    const char *entry = historyEntry(i - 1, &entryLength);
+    if (entryLength >= length && memcmp(entry, prefix, length) == 0)
+    {
+      return i - 1;
+    }
   }
-  return 0;
+  return -1;
 }
 
 /**
- * @brief Status built-in which prints the status of the last process run by
- *        smallsh.
+ * @brief Finds the first history entry from a given entry onwards containing
+ *        some text. The rest of the mapping is searched at once with memmem
+ *        rather than entry by entry, and a match is turned back into its
+ *        entry number by a binary search of the entry offsets.
  *
+ * @param text text to search for
+ * @param length length of the text
+ * @param from entry number to search from
+ * @return int - entry number, or -1 if no later entry matches
  */
-void status()
+int searchHistory(const char *text, size_t length, int from)
 {
-  printf("exit value %d\n", lastProcessStatus);
-  fflush(stdout);
-}
+  while (from < history.count)
+  {
+    size_t start = history.offsets[from];
+    const char *match = memmem(history.map + start, history.indexed - start, text, length);
+    if (!match)
+    {
+      return -1;
+    }
 
-//=============================================================================
-// Handling execution for all other commands
-//=============================================================================
+    int low = from;
+    int high = history.count - 1;
+    size_t offset = match - history.map;
+    while (low < high)
+    {
+      int middle = low + (high - low + 1) / 2;
+      if (history.offsets[middle] <= offset)
+      {
+        low = middle;
+      }
+      else
+      {
+        high = middle - 1;
+      }
+    }
+
+    // a match spanning a newline joins two entries - search on from the second
+    size_t entryLength;
+    historyEntry(low, &entryLength);
+    if (offset + length <= history.offsets[low] + entryLength)
+    {
+      return low;
+    }
+    from = low + 1;
+  }
+  return -1;
+}
 
 /**
- * @brief Function which executes non built-in programs for Small Shell. Arguments
- *        are extracted from the command struct's argument's property and are parsed
- *        for certain flags such as input or output redirection, or running the program
- *        as a background process. The program is run with the execvp function, and
- *        upon success, forks into a child process.
+ * @brief Expands history references in a line of input, as typed at the
+ *        prompt, before it is parsed. !! is the previous command, !n entry n,
+ *        !-n the nth previous command, !?text the newest command containing
+ *        text, and !prefix the newest command beginning with prefix. A !
+ *        within single quotes, after a backslash or $, at the end of the line,
+ *        or followed by a blank, =, (, " or another metacharacter is left
+ *        alone.
  *
- * @param cmd
+ * @param line line of input
+ * @param expanded set to whether any reference was expanded
+ * @return char* - the expanded line, allocated from the command arena, or
+ *         NULL if a reference matched no entry
  */
-void executeProgram(Command *cmd)
+char *expandHistory(const char *line, bool *expanded)
 {
-
-  // pass cmd->args to a helper function which returns the length of the
-  // arguments and detects output/input redirection and background status.
-  int cmdLength = parseArguments(cmd);
-
-  // use arguments length to initialize an argv array to pass to execvp containing
-  // program arguments
-  char *argv[cmdLength + 1];
-  argv[0] = cmd->args[0];
-  argv[cmdLength] = NULL;
-
-  // insert parsed arguments from command struct into argv array
-  for (int i = 1; i < cmdLength; i++)
-  {
-    argv[i] = cmd->args[i];
-  }
-
-  // reference: heavily adapted from Module 4: Process API - Executing a New Program
-  int processStatus;
-  pid_t pid = fork();
-
-  // exit on fork failure
-  if (pid == -1)
-  {
-    perror("Error forking");
-    lastProcessStatus = 1;
-    exit(1);
-  }
-
-  // child
-  else if (pid == 0)
+  *expanded = false;
+  Buffer out = {NULL, 0, 0};
+  bool quoted = false;
+  const char *p = line;
+  while (*p)
   {
-    // if not a background command, setup default action for SIGINT signal
-    if (!cmd->background)
+    const char *bang = p;
+    while (*bang && (quoted || *bang != '!' || strchr(" \t\n=(\"", bang[1]) ||
+                     (bang > line && (bang[-1] == '\\' || bang[-1] == '$'))))
     {
-      struct sigaction SIGINT_action = {0};
-      SIGINT_action.sa_handler = SIG_DFL;
-      sigfillset(&SIGINT_action.sa_mask);
-      SIGINT_action.sa_flags = 0;
-      sigaction(SIGINT, &SIGINT_action, NULL);
+      quoted ^= *bang == '\'';
+      bang++;
+    }
+    appendBuffer(&out, p, bang - p);
+    if (!*bang)
+    {
+      break;
     }
 
-    // initialize infile and outfile pointers
-    int infp;
-    int outfp;
-
-    // if redirect stdin/out evaluates to true, or the process is to be run
-    // in the background, then open the output/input files specified in
-    // the command struct, which are /dev/null by default
-    if (cmd->redirectStdout || cmd->background)
+    // find which entry the reference names, and where it ends
+    int count = syncHistory();
+    int index = -1;
+    const char *end = bang + 1;
+    if (*end == '!')
+    {
+      index = count - 1;
+      end++;
+    }
+    else if (isdigit((unsigned char)*end) || (*end == '-' && isdigit((unsigned char)end[1])))
     {
-      outfp = open(cmd->outputFile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-      if (outfp == -1)
+      char *number;
+      long n = strtol(end, &number, 10);
+      index = n < 0 ? count + n : n - 1;
+      end = number;
+    }
+    else if (*end == '?')
+    {
+      const char *text = end + 1;
+      end = strchrnul(text, '?');
+      for (index = count - 1; index >= 0; index--)
       {
-        fprintf(stderr, "%s: no such file or directory\n", cmd->outputFile);
-        exit(1);
+        size_t length;
+        const char *entry = historyEntry(index, &length);
+        if (memmem(entry, length, text, end - text))
+        {
+          break;
+        }
       }
-      // redirect stdout
-      dup2(outfp, 1);
+      end += *end == '?';
     }
-
-    // same as above, but for redirect stdin
-    if (cmd->redirectStdin || cmd->background)
+    else
     {
-      infp = open(cmd->inputFile, O_RDONLY);
-      if (infp == -1)
+      // a ! before a metacharacter names no entry, and is kept as it is
+      end += strcspn(end, " \t|&;<>'\"");
+      if (end == bang + 1)
       {
-        fprintf(stderr, "%s: no such file or directory\n", cmd->inputFile);
-        exit(1);
+        appendBuffer(&out, "!", 1);
+        p = end;
+        continue;
       }
-      // redirect stdin
-      dup2(infp, 0);
+      index = findHistory(bang + 1, end - bang - 1);
     }
 
-    // execute program and close any open file pointers
-    if (execvp(argv[0], argv) == -1)
+    if (index < 0 || index >= count)
     {
-      perror("Error executing command");
-      exit(1);
+      fprintf(stderr, "smallsh: %.*s: event not found\n", (int)(end - bang), bang);
+      return NULL;
     }
-    if (cmd->redirectStdout)
+    size_t length;
+    const char *entry = historyEntry(index, &length);
+    appendBuffer(&out, entry, length);
+    *expanded = true;
+    p = end;
+  }
+  appendBuffer(&out, "", 1);
+  return out.data;
+}
+
+/**
+ * @brief History built-in - lists history entries with their numbers, as used
+ *        by !n. A count limits the listing to the newest entries, and -s text
+ *        to the entries containing text.
+ *
+ * @param argv arguments of the built-in
+ */
+void listHistory(char **argv)
+{
+  lastProcessStatus = 0;
+  const char *text = NULL;
+  int limit = -1;
+  for (int i = 1; argv[i]; i++)
+  {
+    char *end;
+    if (strcmp(argv[i], "-s") == 0 && argv[i + 1] && !text)
     {
-      close(outfp);
+      text = argv[++i];
     }
-    if (cmd->redirectStdin)
+    else if ((limit = strtol(argv[i], &end, 10)) < 0 || *end || end == argv[i])
     {
-      close(infp);
+      fprintf(stderr, "history: usage: history [-s text] [count]\n");
+      lastProcessStatus = 2;
+      return;
     }
   }
 
-  // parent
-  else
+  int count = syncHistory();
+  int first = limit >= 0 && limit < count ? count - limit : 0;
+  if (text && *text)
   {
-    if (cmd->background)
+    // collect the newest matches so that a count applies to them
+    int *matches = allocate(&commandArena, (count + 1) * sizeof(int));
+    int found = 0;
+    for (int i = searchHistory(text, strlen(text), 0); i != -1; i = searchHistory(text, strlen(text), i + 1))
     {
-      // print pid of background process and add it to global processes array
-      printf("background pid is %d\n", pid);
-      fflush(stdout);
-
-      processes[currentProcess] = pid;
-      currentProcess++;
+      matches[found++] = i;
     }
-    else
+    for (int i = limit >= 0 && limit < found ? found - limit : 0; i < found; i++)
     {
-      // if process was terminated by a signal, print out the termination status
-      waitpid(pid, &processStatus, 0);
-      if (WIFSIGNALED(processStatus))
-      {
-        printf("terminated by signal %d\n", WTERMSIG(processStatus));
-        fflush(stdout);
-      }
-      // update the process exit status
-      if (!processStatus)
-      {
-        lastProcessStatus = 0; // process exited normally
-      }
-      else
-      {
-        lastProcessStatus = 1; // process exited abnormally
-      }
+      size_t length;
+      const char *entry = historyEntry(matches[i], &length);
+      printf("%5d  %.*s\n", matches[i] + 1, (int)length, entry);
+    }
+  }
+  else
+  {
+    for (int i = first; i < count; i++)
+    {
+      size_t length;
+      const char *entry = historyEntry(i, &length);
+      printf("%5d  %.*s\n", i + 1, (int)length, entry);
     }
   }
+  flushOutput();
 }
 
+//=============================================================================
+// Command arena
+//=============================================================================
+
 /**
- * @brief Helper function for processing CLI arguments. This function returns
- *        the length of the arguments, and also looks for for a background process
- *        character, as well as  input or output redirection characters, along with
- *         the specified filename.
+ * @brief Allocates memory from an arena, chaining a new block when the
+ *        current one is full. Allocations are 16 byte aligned. The memory
+ *        is not cleared, so only bytes which are written are touched.
  *
- * @param cmd command struct containing CLI arguments and other properties
- * @return int - length of arguments
+ * @param arena arena to allocate from
+ * @param size number of bytes to allocate
+ * @return void* - the allocated memory
  */
-int parseArguments(Command *cmd)
+void *allocate(Arena *arena, size_t size)
 {
-  int i = 0;
-  int length = 0;
-
-  // scan the arguments array for a & to indicate a background process
-  checkBackgroundProcess(cmd);
+  size = (size + 15) & ~(size_t)15;
 
-  // if a redirect output character or redirected input character are found,
-  // then update the command struct's properties as well as the filenames
-  // specified by the user. then, NULL out the arguments as they aren't needed
-  // to execute the command
-  while (cmd->args[i] != NULL)
+  ArenaBlock *block = arena->head;
+  if (!block || block->size - block->used < size)
   {
-    if (strcmp(cmd->args[i], REDIRECT_STDOUT) == 0)
+    size_t blockSize = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+    block = malloc(sizeof(ArenaBlock) + blockSize);
+    if (!block)
     {
-      cmd->redirectStdout = true;
-      cmd->args[i] = NULL;
-
-      cmd->outputFile = cmd->args[i + 1];
-      cmd->args[i + 1] = NULL;
-
-      i += 2;
-      continue;
+      perror("Error allocating memory");
+      exit(1);
     }
+    block->next = arena->head;
+    block->size = blockSize;
+    block->used = 0;
+    arena->head = block;
+  }
 
-    if (strcmp(cmd->args[i], REDIRECT_STDIN) == 0)
-    {
-      cmd->redirectStdin = true;
-      cmd->args[i] = NULL;
-
-      cmd->inputFile = cmd->args[i + 1];
-      cmd->args[i + 1] = NULL;
-
-      i += 2;
-      continue;
-    }
+  void *data = block->data + block->used;
+  block->used += size;
+  arena->total += size;
+  return data;
+}
 
-    i++;
-    length++;
+/**
+ * @brief Grows an allocation from an arena. The most recent allocation is
+ *        extended in place when its block has room - otherwise the data is
+ *        copied into a new allocation.
+ *
+ * @param arena arena the data was allocated from
+ * @param data existing allocation, or NULL
+ * @param size current size of the allocation
+ * @param newSize size to grow the allocation to
+ * @return void* - the grown allocation
+ */
+void *reallocate(Arena *arena, void *data, size_t size, size_t newSize)
+{
+  ArenaBlock *block = arena->head;
+  size_t aligned = (size + 15) & ~(size_t)15;
+  size_t newAligned = (newSize + 15) & ~(size_t)15;
+  if (data && block && (char *)data + aligned == block->data + block->used &&
+      block->size - block->used >= newAligned - aligned)
+  {
+    block->used += newAligned - aligned;
+    arena->total += newAligned - aligned;
+    return data;
   }
 
-  return length;
+  void *grown = allocate(arena, newSize);
+  if (data)
+  {
+    memcpy(grown, data, size);
+  }
+  return grown;
 }
 
 /**
- * @brief Scans the parsed arguments array looking for an ampersand & to indicate
- *        that the process should be run in the background. If so, the element is
- *        NULLed out, and input/output point to /dev/null by default.
+ * @brief Releases everything allocated from an arena. When the last command
+ *        needed more than one block, they are replaced by a single block large
+ *        enough for all of it, so that steady state needs no further mallocs.
  *
- *        If foreground only mode is on, the & character is ignored.
- *
- * @param cmd command struct
+ * @param arena arena to reset
  */
-void checkBackgroundProcess(Command *cmd)
+void resetArena(Arena *arena)
 {
-  int i = 0;
-  while (cmd->args[i] != NULL)
+  ArenaBlock *block = arena->head;
+  if (block && block->next)
   {
-    // last character in args
-    if (strcmp(cmd->args[i], EXECUTE_BG) == 0 && !cmd->args[i + 1])
+    size_t total = arena->total;
+    while (block)
     {
-      if (!foregroundOnly)
-      {
-        cmd->background = true;
-        cmd->inputFile = "/dev/null";
-        cmd->outputFile = "/dev/null";
-      }
-      cmd->args[i] = NULL;
-      break;
+      ArenaBlock *next = block->next;
+      free(block);
+      block = next;
     }
-    i++;
+    arena->head = NULL;
+    allocate(arena, total);
+    block = arena->head;
+  }
+
+  if (block)
+  {
+    block->used = 0;
   }
+  arena->total = 0;
 }
 
 /**
- * @brief Handles entry or exit from foreground only mode, changing the program's
- *        foreground state and printing its status.
+ * @brief Appends bytes to a buffer allocated from the command arena, doubling
+ *        its capacity as needed.
+ *
+ * @param buffer buffer to append to
+ * @param data bytes to append
+ * @param length number of bytes
  */
-void foregroundOnlyMode()
+void appendBuffer(Buffer *buffer, const char *data, size_t length)
 {
-  char *message;
-  int count;
-  if (!foregroundOnly)
-  {
-    message = "Entering Foreground only mode\n";
-    count = 30;
-    foregroundOnly = true;
-  }
-  else
+  if (buffer->length + length > buffer->capacity)
   {
-    message = "Exiting Foreground only mode\n";
-    count = 29;
-    foregroundOnly = false;
+    size_t capacity = buffer->capacity ? buffer->capacity : 64;
+    while (capacity < buffer->length + length)
+    {
+      capacity *= 2;
+    }
+    buffer->data = reallocate(&commandArena, buffer->data, buffer->length, capacity);
+    buffer->capacity = capacity;
   }
-  write(STDOUT_FILENO, message, count);
-  fflush(stdout);
+  memcpy(buffer->data + buffer->length, data, length);
+  buffer->length += length;
 }